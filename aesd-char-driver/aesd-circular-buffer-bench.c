@@ -0,0 +1,199 @@
+/*
+ * aesd-circular-buffer-bench.c
+ *
+ *  Userspace benchmark for the position lookup in aesd-circular-buffer.c,
+ *  built from the same source the driver uses. Fills a buffer of the given
+ *  capacity, then times a sequential reader walking the whole history with
+ *  aesd_circular_buffer_find_entry_offset_for_fpos, the way aesd_read
+ *  looks up *f_pos on every call, and a seek to every entry with
+ *  aesd_circular_buffer_offset_of as AESDCHAR_IOCSEEKTO does. The same
+ *  walks done with a linear scan from the oldest entry are timed as a
+ *  reference. Last, the whole history is copied out in reads of the given
+ *  size, once from entries in separate allocations and once from a buffer
+ *  keeping the same entries in its byte ring.
+ *
+ *  Usage: aesd-circular-buffer-bench [-c capacity] [-s entry size] [-b read size]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "aesd-circular-buffer.h"
+
+static double nowSeconds(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * The lookup as it was before the prefix offsets, walking from the oldest entry
+ */
+static struct aesd_buffer_entry *linearFind(struct aesd_circular_buffer *buffer, size_t char_offset, size_t *entry_offset){
+    struct aesd_buffer_entry *entry;
+    uint32_t n = 0;
+
+    while ((entry = aesd_circular_buffer_entry_at(buffer, n++)) != NULL) {
+        if (char_offset < entry->size) {
+            *entry_offset = char_offset;
+            return entry;
+        }
+        char_offset -= entry->size;
+    }
+    return NULL;
+}
+
+/*
+ * Copy a read from entries in separate allocations, one memcpy per entry as aesd_read does
+ */
+static size_t entryCopy(struct aesd_circular_buffer *buffer, size_t char_offset, char *dest, size_t count){
+    struct aesd_circular_buffer_iter iter;
+    size_t entry_offset, copied = 0;
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_iter_fpos(buffer, char_offset, &entry_offset, &iter);
+
+    while (entry != NULL && copied < count) {
+        size_t len = entry->size - entry_offset < count - copied ? entry->size - entry_offset : count - copied;
+        memcpy(dest + copied, entry->buffptr + entry_offset, len);
+        copied += len;
+        entry_offset = 0;
+        entry = aesd_circular_buffer_iter_next(&iter);
+    }
+    return copied;
+}
+
+static size_t linearOffset(struct aesd_circular_buffer *buffer, uint32_t n){
+    size_t offset = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        offset += aesd_circular_buffer_entry_at(buffer, i)->size;
+    }
+    return offset;
+}
+
+int main(int argc, char *argv[]){
+    long capacity = 4096, entry_size = 64, read_size = 4096;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:s:b:")) != -1) {
+        switch (opt) {
+        case 'c': capacity = atol(optarg); break;
+        case 's': entry_size = atol(optarg); break;
+        case 'b': read_size = atol(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-c capacity] [-s entry size] [-b read size]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (capacity < 1 || capacity > AESDCHAR_MAX_CAPACITY || entry_size < 1 || read_size < 1) {
+        fprintf(stderr, "Capacity must be 1 to %u, entry and read size positive\n", AESDCHAR_MAX_CAPACITY);
+        return 1;
+    }
+
+    struct aesd_circular_buffer buffer;
+    uint32_t slots = 1;
+    while (slots < capacity) slots <<= 1;
+    struct aesd_buffer_entry *entries = calloc(slots, sizeof(struct aesd_buffer_entry));
+    char *data = malloc(entry_size);
+    if (entries == NULL || data == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    memset(data, 'a', entry_size);
+    aesd_circular_buffer_init(&buffer);
+    aesd_circular_buffer_move(&buffer, entries, slots, capacity);
+    for (long i = 0; i < capacity + capacity / 2; i++) {    //Wrap the ring so out_offs is not at slot 0
+        struct aesd_buffer_entry entry = { data, entry_size };
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+
+    size_t total = buffer.total_size, entry_offset;
+    unsigned long long check = 0;
+    double start, indexed_read, linear_read, indexed_seek, linear_seek;
+
+    start = nowSeconds();
+    for (size_t pos = 0; pos < total; pos += read_size) {
+        check += aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, pos, &entry_offset)->size + entry_offset;
+    }
+    indexed_read = nowSeconds() - start;
+    start = nowSeconds();
+    for (size_t pos = 0; pos < total; pos += read_size) {
+        check -= linearFind(&buffer, pos, &entry_offset)->size + entry_offset;
+    }
+    linear_read = nowSeconds() - start;
+
+    start = nowSeconds();
+    for (uint32_t n = 0; n < capacity; n++) {
+        check += aesd_circular_buffer_offset_of(&buffer, n);
+    }
+    indexed_seek = nowSeconds() - start;
+    start = nowSeconds();
+    for (uint32_t n = 0; n < capacity; n++) {
+        check -= linearOffset(&buffer, n);
+    }
+    linear_seek = nowSeconds() - start;
+
+    if (check != 0) {
+        fprintf(stderr, "Indexed and linear lookups disagree\n");
+        return 1;
+    }
+
+    /* Separate allocations per entry, as the driver makes them, against the same bytes kept in a ring */
+    struct aesd_circular_buffer ring_buffer;
+    size_t ring_size = 1;
+    while (ring_size < total) ring_size <<= 1;
+    char *ring = malloc(ring_size), *dest = malloc(read_size);
+    struct aesd_buffer_entry *ring_entries = calloc(slots, sizeof(struct aesd_buffer_entry));
+    if (ring == NULL || dest == NULL || ring_entries == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    aesd_circular_buffer_init(&ring_buffer);
+    aesd_circular_buffer_move(&ring_buffer, ring_entries, slots, capacity);
+    aesd_circular_buffer_use_ring(&ring_buffer, ring, ring_size);
+    for (uint32_t n = 0; n < capacity; n++) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(&buffer, n);
+        char *copy = malloc(entry_size);
+        if (copy == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        memset(copy, 'a' + n % 26, entry_size);
+        entry->buffptr = copy;
+        aesd_circular_buffer_add_bytes(&ring_buffer, copy, entry_size);
+    }
+    double entry_copy, ring_copy;
+    start = nowSeconds();
+    for (size_t pos = 0; pos < total; pos += read_size) {
+        check += entryCopy(&buffer, pos, dest, read_size) + dest[0];
+    }
+    entry_copy = nowSeconds() - start;
+    start = nowSeconds();
+    for (size_t pos = 0; pos < total; pos += read_size) {
+        check -= aesd_circular_buffer_copy(&ring_buffer, pos, dest, read_size) + dest[0];
+    }
+    ring_copy = nowSeconds() - start;
+    if (check != 0) {
+        fprintf(stderr, "Entry and ring copies disagree\n");
+        return 1;
+    }
+
+    size_t lookups = (total + read_size - 1) / read_size;
+    printf("capacity:          %ld entries of %ld bytes\n", capacity, entry_size);
+    printf("history:           %zu bytes, %zu reads of %ld\n", total, lookups, read_size);
+    printf("read lookup:       %10.1f ns indexed  %12.1f ns linear\n", indexed_read * 1e9 / lookups, linear_read * 1e9 / lookups);
+    printf("seek to entry:     %10.1f ns indexed  %12.1f ns linear\n", indexed_seek * 1e9 / capacity, linear_seek * 1e9 / capacity);
+    printf("full history read: %10.3f ms indexed  %12.3f ms linear\n", indexed_read * 1e3, linear_read * 1e3);
+    printf("full history copy: %10.3f ms ring     %12.3f ms separate entries\n", ring_copy * 1e3, entry_copy * 1e3);
+
+    for (uint32_t n = 0; n < capacity; n++) {
+        free((char *) aesd_circular_buffer_entry_at(&buffer, n)->buffptr);
+    }
+    free(ring_entries);
+    free(ring);
+    free(dest);
+    free(data);
+    free(entries);
+    return 0;
+}
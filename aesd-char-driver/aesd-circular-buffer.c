@@ -16,7 +16,18 @@
 
 #include "aesd-circular-buffer.h"
 
-#define indexing(index) (index%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+#define indexing(buffer,index) ((index)&(buffer)->mask)
+
+/**
+ * @return the number of entries held by @param buffer
+ */
+uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+	if(buffer->full){
+		return buffer->capacity;
+	}
+	return indexing(buffer,buffer->in_offs-buffer->out_offs);
+}
 
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
@@ -25,81 +36,295 @@
  * @param entry_offset_byte_rtn is a pointer specifying a location to store the byte of the returned aesd_buffer_entry
  *      buffptr member corresponding to char_offset.  This value is only set when a matching char_offset is found
  *      in aesd_buffer.
+ * @param iter is set to the returned entry, so aesd_circular_buffer_iter_next continues with the entries written
+ *      after it.  This value is only set when a matching char_offset is found.
  * @return the struct aesd_buffer_entry structure representing the position described by char_offset, or
  * NULL if this position is not available in the buffer (not enough data is written).
  */
-struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
-            size_t char_offset, size_t *entry_offset_byte_rtn )
+struct aesd_buffer_entry *aesd_circular_buffer_iter_fpos(struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t *entry_offset_byte_rtn, struct aesd_circular_buffer_iter *iter)
 {
-	size_t fpos_off=0;
-	uint8_t start=buffer->out_offs;
-	uint8_t end=buffer->in_offs;
-	uint8_t total=AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-
-	if(buffer->full==false){
-		if(start<end){
-			total=end-start;
-		}
-		else if(start>end){
-			total=total-start;
-			total=total+end;
+	uint32_t total=aesd_circular_buffer_count(buffer);
+	uint32_t low=0, high=total;
+	size_t first;
+
+	if(char_offset>=buffer->total_size){
+		return NULL;
+	}
+	first=buffer->entry[buffer->out_offs].start;
+	while(high-low>1){                      //Find the newest entry starting at or before char_offset
+		uint32_t mid=low+(high-low)/2;
+		if(buffer->entry[indexing(buffer,buffer->out_offs+mid)].start-first<=char_offset){
+			low=mid;
 		}
 		else{
-			total=0;
+			high=mid;
 		}
 	}
+	iter->buffer=buffer;
+	iter->index=indexing(buffer,buffer->out_offs+low);
+	iter->remaining=total-low-1;
+	*entry_offset_byte_rtn=char_offset-(buffer->entry[iter->index].start-first);
+	return &(buffer->entry[iter->index]);
+}
 
-	while(total){
-		
-		struct aesd_buffer_entry *entryptr=&((buffer)->entry[start]);
-		size_t size=entryptr->size;
-		fpos_off=fpos_off+size;
-		if(fpos_off>char_offset){
-			*entry_offset_byte_rtn=char_offset-fpos_off+size;
-			return entryptr;
-		}
-		start=start+1;
-		if(start==AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED){
-			start=0;
-		}
-		total--;
+/**
+ * @param iter an iterator set by aesd_circular_buffer_iter_fpos.  The buffer must not be changed while it is in use,
+ *      any necessary locking must be performed by caller.
+ * @return the entry written after the iterator's current one, which the iterator moves to, or NULL once the
+ *      newest entry has been passed.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_iter_next(struct aesd_circular_buffer_iter *iter)
+{
+	if(iter->remaining==0){
+		return NULL;
 	}
+	iter->remaining--;
+	iter->index=indexing(iter->buffer,iter->index+1);
+	return &(iter->buffer->entry[iter->index]);
+}
+
+/**
+ * Same as aesd_circular_buffer_iter_fpos, for callers that only need the one entry.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t *entry_offset_byte_rtn )
+{
+	struct aesd_circular_buffer_iter iter;
+
+	return aesd_circular_buffer_iter_fpos(buffer, char_offset, entry_offset_byte_rtn, &iter);
+}
 
+/**
+ * @return the zero referenced @param n th oldest entry of @param buffer, or NULL if it holds fewer entries.
+ * Any necessary locking must be performed by caller.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer, uint32_t n)
+{
+	if(n>=aesd_circular_buffer_count(buffer)){
+		return NULL;
+	}
+	return &(buffer->entry[indexing(buffer,buffer->out_offs+n)]);
+}
 
-	return NULL;
+/**
+ * @return the offset of the zero referenced @param n th oldest entry of @param buffer in the concatenated contents,
+ * or the total size of the contents if it holds @param n entries or fewer.  Any necessary locking must be performed by caller.
+ */
+size_t aesd_circular_buffer_offset_of(struct aesd_circular_buffer *buffer, uint32_t n)
+{
+	if(n>=aesd_circular_buffer_count(buffer)){
+		return buffer->total_size;
+	}
+	return buffer->entry[indexing(buffer,buffer->out_offs+n)].start-buffer->entry[buffer->out_offs].start;
 }
 
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
 * If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
 * new start location.
+* buffer->byte_limit is not checked here, call aesd_circular_buffer_evict_for first to apply it.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* @return the buffptr of the entry that was overwritten, for the caller to free, or NULL if nothing was
 */
-void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
-    if(buffer->in_offs == (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1)){
-        
-        memcpy(&(buffer->entry[buffer->in_offs]), add_entry, sizeof(struct aesd_buffer_entry));
-        if(buffer->in_offs == buffer->out_offs)
-        	buffer->out_offs = 0;
-        buffer->in_offs = 0;
-        buffer->full = true;
-    }
-    
-    else if(buffer->full == true){
-
-    	if(buffer->in_offs == buffer->out_offs) buffer->out_offs++;
-
-    	memcpy(&(buffer->entry[buffer->in_offs++]), add_entry, sizeof(struct aesd_buffer_entry));
-    }
-    else memcpy(&(buffer->entry[buffer->in_offs++]), add_entry, sizeof(struct aesd_buffer_entry));
+	struct aesd_buffer_entry removed = { NULL, 0 };
+
+	if(buffer->full){
+		aesd_circular_buffer_remove_oldest(buffer, &removed);
+	}
+	memcpy(&(buffer->entry[buffer->in_offs]), add_entry, sizeof(struct aesd_buffer_entry));
+	buffer->entry[buffer->in_offs].start=buffer->end;
+	buffer->total_size+=add_entry->size;
+	buffer->end+=add_entry->size;
+	buffer->in_offs=indexing(buffer,buffer->in_offs+1);
+	if(indexing(buffer,buffer->in_offs-buffer->out_offs)==indexing(buffer,buffer->capacity)){
+		buffer->full=true;
+	}
+	return removed.buffptr;
+}
+
+/**
+* Makes room for an entry of @param size bytes by taking the oldest entry out of @param buffer, copying it to
+* @param removed, when the buffer is full or adding the entry would go over buffer->byte_limit, or over the ring size
+* for a buffer with a ring.  Call until it returns false, then add the entry; an entry larger than the limit on its
+* own empties the buffer.
+* Any necessary locking must be handled by the caller
+* @return true if an entry was taken out and its buffptr needs to be freed by the caller, entries kept in the
+* ring need no freeing
+*/
+bool aesd_circular_buffer_evict_for(struct aesd_circular_buffer *buffer, size_t size,
+            struct aesd_buffer_entry *removed)
+{
+	size_t limit=buffer->byte_limit;
+
+	if(buffer->ring!=NULL && (limit==0 || limit>buffer->ring_size)){
+		limit=buffer->ring_size;                //Older bytes would be overwritten
+	}
+	if(!buffer->full && (limit==0 || buffer->total_size+size<=limit)){
+		return false;
+	}
+	return aesd_circular_buffer_remove_oldest(buffer, removed);
+}
+
+/**
+* Keeps the contents of entries added from now on in @param ring, @param size bytes that must be a power of two, instead
+* of the caller's allocations, or goes back to those when @param ring is NULL.  The buffer must be empty.
+* Any necessary locking must be handled by the caller
+* @return false if the buffer holds entries or size is not a power of two
+*/
+bool aesd_circular_buffer_use_ring(struct aesd_circular_buffer *buffer, char *ring, size_t size)
+{
+	if(aesd_circular_buffer_count(buffer)!=0 || (ring!=NULL && (size==0 || (size&(size-1))!=0))){
+		return false;
+	}
+	buffer->ring=ring;
+	buffer->ring_size=ring!=NULL ? size : 0;
+	return true;
+}
+
+/**
+* Copies @param size bytes from @param data to the end of the ring of @param buffer and adds them as an entry.
+* Call aesd_circular_buffer_evict_for first, so the bytes overwritten no longer belong to an entry.
+* Any necessary locking must be handled by the caller
+* @return the new entry's buffptr, or NULL if the buffer has no ring or size is larger than the ring
+*/
+const char *aesd_circular_buffer_add_bytes(struct aesd_circular_buffer *buffer, const char *data, size_t size)
+{
+	struct aesd_buffer_entry entry;
+	size_t pos, first;
+
+	if(buffer->ring==NULL || size>buffer->ring_size){
+		return NULL;
+	}
+	pos=buffer->end&(buffer->ring_size-1);
+	first=(size<buffer->ring_size-pos) ? size : buffer->ring_size-pos;
+	memcpy(&(buffer->ring[pos]),data,first);
+	memcpy(buffer->ring,data+first,size-first);   //The part wrapping past the end of the ring, if any
+	entry.buffptr=&(buffer->ring[pos]);
+	entry.size=size;
+	aesd_circular_buffer_add_entry(buffer,&entry);
+	return entry.buffptr;
+}
+
+/**
+* Finds the contents of a buffer with a ring at @param char_offset, the zero referenced character index if all
+* entries were concatenated end to end, and sets @param span to them.  Any necessary locking must be performed by caller.
+* @return the bytes that can be read from span in one piece, at most @param count, or 0 at the end of the contents
+* or without a ring.  Reading count bytes takes at most two calls, the second one after wrapping to the start of the ring
+*/
+size_t aesd_circular_buffer_span(struct aesd_circular_buffer *buffer, size_t char_offset, size_t count,
+            const char **span)
+{
+	size_t pos, run;
+
+	if(buffer->ring==NULL || char_offset>=buffer->total_size){
+		return 0;
+	}
+	pos=(buffer->end-buffer->total_size+char_offset)&(buffer->ring_size-1);
+	run=buffer->total_size-char_offset;
+	if(run>buffer->ring_size-pos){
+		run=buffer->ring_size-pos;
+	}
+	if(run>count){
+		run=count;
+	}
+	*span=&(buffer->ring[pos]);
+	return run;
+}
+
+/**
+* Copies up to @param count bytes of a buffer with a ring, starting at @param char_offset in the concatenated contents,
+* to @param dest with at most two memcpy calls.  Any necessary locking must be performed by caller.
+* @return the bytes copied, fewer than count at the end of the contents
+*/
+size_t aesd_circular_buffer_copy(struct aesd_circular_buffer *buffer, size_t char_offset, char *dest, size_t count)
+{
+	const char *span;
+	size_t copied=0, run;
+
+	while(copied<count && (run=aesd_circular_buffer_span(buffer,char_offset+copied,count-copied,&span))!=0){
+		memcpy(dest+copied,span,run);
+		copied+=run;
+	}
+	return copied;
+}
+
+/**
+* Takes the oldest entry out of @param buffer, copying it to @param removed when that is not NULL.
+* Any necessary locking must be handled by the caller
+* @return false if the buffer was empty
+*/
+bool aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed)
+{
+	struct aesd_buffer_entry *oldest;
+
+	if(aesd_circular_buffer_count(buffer)==0){
+		return false;
+	}
+	oldest=&(buffer->entry[buffer->out_offs]);
+	if(removed){
+		*removed=*oldest;
+	}
+	buffer->total_size-=oldest->size;
+	oldest->buffptr=NULL;                   //Slots outside the live entries always read as empty
+	oldest->size=0;
+	buffer->out_offs=indexing(buffer,buffer->out_offs+1);
+	buffer->full=false;
+	return true;
+}
+
+/**
+* Moves the entries of @param buffer, oldest first, to the start of @param entries and uses it as the buffer's
+* storage from now on.  @param slots must be a power of two no smaller than @param capacity, and the buffer must not
+* hold more than @param capacity entries, remove the oldest first when shrinking.  @param entries may be NULL
+* to return to the built in slots, when capacity is at most AESDCHAR_INLINE_ENTRY_SLOTS.
+* Any necessary locking must be handled by the caller
+* @return the storage used before, which the caller frees unless it is the buffer's entry_inline
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_move(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entries, uint32_t slots, uint32_t capacity)
+{
+	struct aesd_buffer_entry *old=buffer->entry;
+	struct aesd_buffer_entry moved[AESDCHAR_INLINE_ENTRY_SLOTS];
+	uint32_t count=aesd_circular_buffer_count(buffer);
+	uint32_t i;
+
+	if(entries==NULL){                      //Going back to the built in slots, which may be the ones in use now
+		for(i=0;i<count;i++){
+			moved[i]=buffer->entry[indexing(buffer,buffer->out_offs+i)];
+		}
+		memset(buffer->entry_inline,0,sizeof(buffer->entry_inline));
+		memcpy(buffer->entry_inline,moved,count*sizeof(struct aesd_buffer_entry));
+		entries=buffer->entry_inline;
+		slots=AESDCHAR_INLINE_ENTRY_SLOTS;
+	}
+	else{
+		memset(entries,0,slots*sizeof(struct aesd_buffer_entry));
+		for(i=0;i<count;i++){
+			entries[i]=buffer->entry[indexing(buffer,buffer->out_offs+i)];
+		}
+	}
+
+	buffer->entry=entries;
+	buffer->mask=slots-1;
+	buffer->capacity=capacity;
+	buffer->out_offs=0;
+	buffer->in_offs=indexing(buffer,count);
+	buffer->full=(count==capacity);
+	return old;
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Initializes the circular buffer described by @param buffer to an empty struct, holding up to
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries in its built in slots
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry=buffer->entry_inline;
+    buffer->mask=AESDCHAR_INLINE_ENTRY_SLOTS-1;
+    buffer->capacity=AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
 }
@@ -16,56 +16,156 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Default number of writes kept, the capacity a buffer has after aesd_circular_buffer_init
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Entry slots built into the buffer structure, the power of two that holds the default capacity
+ */
+#define AESDCHAR_INLINE_ENTRY_SLOTS 16
+/**
+ * Largest capacity a buffer can be given
+ */
+#define AESDCHAR_MAX_CAPACITY (1U << 20)
 
 struct aesd_buffer_entry
 {
     /**
-     * A location where the buffer contents in buffptr are stored
+     * A location where the buffer contents in buffptr are stored.  For an entry kept in the buffer's ring this is
+     * where the entry starts in the ring, and the contents continue at the start of the ring if they wrap
      */
     const char *buffptr;
     /**
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Bytes added to the buffer before this entry, set by aesd_circular_buffer_add_entry.  Only the difference
+     * to the oldest entry's value is meaningful, it is the entry's offset in the concatenated buffer contents
+     */
+    size_t start;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations,
+     * a power of two slots long so positions wrap with a mask
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * Number of slots in entry minus one
+     */
+    uint32_t mask;
+    /**
+     * Most entries kept before the oldest is overwritten, at most mask + 1
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t capacity;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
-     * set to true when the buffer entry structure is full
+     * set to true when the buffer holds capacity entries
      */
     bool full;
+    /**
+     * Bytes held by the entries in the buffer
+     */
+    size_t total_size;
+    /**
+     * Bytes added to the buffer since it was initialized, the start of the next entry.  Wraps harmlessly,
+     * only differences are used
+     */
+    size_t end;
+    /**
+     * Most bytes kept before the oldest entries are dropped, 0 to only limit the number of entries
+     */
+    size_t byte_limit;
+    /**
+     * Contiguous storage the contents of entries added with aesd_circular_buffer_add_bytes are copied to, NULL
+     * when every entry's buffptr is managed by the caller
+     */
+    char *ring;
+    /**
+     * Bytes in ring, a power of two.  No more than this many are kept, whatever byte_limit says
+     */
+    size_t ring_size;
+    /**
+     * Slots used by entry until other storage is given with aesd_circular_buffer_move
+     */
+    struct aesd_buffer_entry entry_inline[AESDCHAR_INLINE_ENTRY_SLOTS];
 };
 
+/**
+ * Position within a circular buffer, walked oldest entry to newest with aesd_circular_buffer_iter_next
+ */
+struct aesd_circular_buffer_iter
+{
+    /**
+     * The buffer being walked
+     */
+    struct aesd_circular_buffer *buffer;
+    /**
+     * Location in the entry structure of the current entry
+     */
+    uint32_t index;
+    /**
+     * Entries left to visit after the current one
+     */
+    uint32_t remaining;
+};
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_iter_fpos(struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t *entry_offset_byte_rtn, struct aesd_circular_buffer_iter *iter);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_iter_next(struct aesd_circular_buffer_iter *iter);
+
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
-extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+extern struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer, uint32_t n);
+
+extern size_t aesd_circular_buffer_offset_of(struct aesd_circular_buffer *buffer, uint32_t n);
+
+extern uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer);
+
+extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+
+extern bool aesd_circular_buffer_evict_for(struct aesd_circular_buffer *buffer, size_t size,
+            struct aesd_buffer_entry *removed);
+
+extern bool aesd_circular_buffer_use_ring(struct aesd_circular_buffer *buffer, char *ring, size_t size);
+
+extern const char *aesd_circular_buffer_add_bytes(struct aesd_circular_buffer *buffer, const char *data, size_t size);
+
+extern size_t aesd_circular_buffer_span(struct aesd_circular_buffer *buffer, size_t char_offset, size_t count,
+            const char **span);
+
+extern size_t aesd_circular_buffer_copy(struct aesd_circular_buffer *buffer, size_t char_offset, char *dest, size_t count);
+
+extern bool aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_move(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entries, uint32_t slots, uint32_t capacity);
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
+ * Slots not holding an entry have a NULL buffptr
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -74,7 +174,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<=(buffer)->mask; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
@@ -0,0 +1,180 @@
+/*
+ * aesd-lockfree-buffer-bench.c
+ *
+ *  Userspace benchmark for aesd-lockfree-buffer.c. Producer threads hand
+ *  entries to a consumer on the main thread, once through the lock-free
+ *  buffer and once through aesd_circular_buffer behind a mutex, the way its
+ *  users lock it, first with a single producer and then with the given
+ *  number of producers. Every entry carries its producer and sequence
+ *  number, so the consumer also checks none are lost or reordered.
+ *
+ *  Usage: aesd-lockfree-buffer-bench [-n entries] [-p producers]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "aesd-circular-buffer.h"
+#include "aesd-lockfree-buffer.h"
+
+#define BENCH_SLOTS 64
+#define BENCH_MAX_PRODUCERS 64
+
+struct producerArgs {
+    struct aesd_lockfree_buffer *buffer;
+    uintptr_t producer;
+    size_t entries;
+};
+
+static pthread_mutex_t locked_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct aesd_circular_buffer locked_buffer;
+
+static double nowSeconds(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Yield while the other side is likely to catch up soon, sleep once it has not so a single CPU still progresses
+ */
+static void backOff(unsigned *attempts){
+    if (++*attempts < 64) {
+        sched_yield();
+    } else {
+        struct timespec pause = { 0, 10000 };
+        nanosleep(&pause, NULL);
+    }
+}
+
+static void *lockfreeProducer(void *arg){
+    struct producerArgs *args = arg;
+    unsigned attempts = 0;
+
+    for (size_t seq = 0; seq < args->entries; seq++) {
+        struct aesd_buffer_entry entry = { (const char *) (args->producer + 1), seq };
+        while (!aesd_lockfree_buffer_add_entry(args->buffer, &entry)) {
+            backOff(&attempts);
+        }
+        attempts = 0;
+    }
+    return NULL;
+}
+
+static void *lockedProducer(void *arg){
+    struct producerArgs *args = arg;
+    unsigned attempts = 0;
+
+    for (size_t seq = 0; seq < args->entries; seq++) {
+        struct aesd_buffer_entry entry = { (const char *) (args->producer + 1), seq };
+        bool added = false;
+        while (!added) {
+            pthread_mutex_lock(&locked_mutex);
+            added = !locked_buffer.full;
+            if (added) aesd_circular_buffer_add_entry(&locked_buffer, &entry);
+            pthread_mutex_unlock(&locked_mutex);
+            if (!added) backOff(&attempts);
+        }
+        attempts = 0;
+    }
+    return NULL;
+}
+
+static bool lockfreeRemove(struct aesd_lockfree_buffer *buffer, struct aesd_buffer_entry *removed){
+    return aesd_lockfree_buffer_remove_oldest(buffer, removed);
+}
+
+static bool lockedRemove(struct aesd_lockfree_buffer *buffer, struct aesd_buffer_entry *removed){
+    (void) buffer;
+    pthread_mutex_lock(&locked_mutex);
+    bool ok = aesd_circular_buffer_remove_oldest(&locked_buffer, removed);
+    pthread_mutex_unlock(&locked_mutex);
+    return ok;
+}
+
+/*
+ * Start the producers, take their entries on this thread and check each producer's arrive in order
+ * Returns the entries handed over per second, or a negative value if one was lost or reordered
+ */
+static double handOver(void *(*producer)(void *), bool (*remove)(struct aesd_lockfree_buffer *, struct aesd_buffer_entry *),
+                       struct aesd_lockfree_buffer *buffer, size_t producers, size_t entries){
+    struct producerArgs args[BENCH_MAX_PRODUCERS];
+    pthread_t threads[BENCH_MAX_PRODUCERS];
+    size_t next_seq[BENCH_MAX_PRODUCERS] = { 0 };
+    struct aesd_buffer_entry removed;
+    unsigned attempts = 0;
+    bool in_order = true;
+
+    double start = nowSeconds();
+    for (size_t i = 0; i < producers; i++) {
+        args[i] = (struct producerArgs) { buffer, i, entries };
+        if (pthread_create(&threads[i], NULL, producer, &args[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (size_t received = 0; received < producers * entries; received++) {
+        while (!remove(buffer, &removed)) {
+            backOff(&attempts);
+        }
+        attempts = 0;
+        uintptr_t from = (uintptr_t) removed.buffptr - 1;
+        if (from >= producers || next_seq[from] != removed.size) {
+            in_order = false;   //Keep draining so the producers can finish and be joined
+        } else {
+            next_seq[from]++;
+        }
+    }
+    for (size_t i = 0; i < producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = nowSeconds() - start;
+    return in_order ? producers * entries / elapsed : -1;
+}
+
+/*
+ * Time both buffers with the given producers splitting the entries between them
+ */
+static bool compare(size_t producers, size_t entries){
+    struct aesd_lockfree_slot slots[BENCH_SLOTS];
+    struct aesd_lockfree_buffer buffer;
+
+    aesd_lockfree_buffer_init(&buffer, slots, BENCH_SLOTS, producers > 1);
+    double lockfree = handOver(lockfreeProducer, lockfreeRemove, &buffer, producers, entries / producers);
+    aesd_circular_buffer_init(&locked_buffer);
+    double locked = handOver(lockedProducer, lockedRemove, NULL, producers, entries / producers);
+    if (lockfree < 0 || locked < 0) {
+        fprintf(stderr, "%s buffer lost or reordered entries\n", lockfree < 0 ? "Lock-free" : "Locked");
+        return false;
+    }
+    printf("%3zu producers:     %12.0f entries/s lock-free  %12.0f entries/s mutex\n", producers, lockfree, locked);
+    return true;
+}
+
+int main(int argc, char *argv[]){
+    long entries = 1000000, producers = 4;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:p:")) != -1) {
+        switch (opt) {
+        case 'n': entries = atol(optarg); break;
+        case 'p': producers = atol(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n entries] [-p producers]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (entries < 1 || producers < 1 || producers > BENCH_MAX_PRODUCERS) {
+        fprintf(stderr, "Entries must be positive, producers 1 to %d\n", BENCH_MAX_PRODUCERS);
+        return 1;
+    }
+
+    printf("entries:           %ld through %d slots\n", entries, BENCH_SLOTS);
+    if (!compare(1, entries)) return 1;
+    if (producers > 1 && !compare(producers, entries)) return 1;
+    return 0;
+}
@@ -0,0 +1,168 @@
+/**
+ * @file aesd-lockfree-buffer.c
+ * @brief Lock-free circular buffer with one or many producers and a single consumer
+ *
+ * Each slot carries a sequence number as in a bounded Vyukov queue.  A producer owns the slot at position p once it
+ * has claimed head p while the slot's seq is p, and publishes the entry by setting seq to p + 1.  The consumer owns
+ * published slots until it takes them out, setting seq to p + slots so the slot is free again one lap later.
+ * With several producers entries may be published out of order, the consumer only sees the entries published
+ * without a gap after the oldest one.
+ */
+
+#include <string.h>
+
+#include "aesd-lockfree-buffer.h"
+
+#define indexing(buffer,position) ((position)&(buffer)->mask)
+
+/**
+ * Initializes @param buffer to an empty buffer stored in the @param count entries of @param slots, which must be a
+ * power of two.  Set @param multi_producer if several threads will add entries at once.
+ * @return false if count is not a power of two
+ */
+bool aesd_lockfree_buffer_init(struct aesd_lockfree_buffer *buffer, struct aesd_lockfree_slot *slots,
+            size_t count, bool multi_producer)
+{
+	size_t i;
+
+	if(count==0 || (count&(count-1))!=0){
+		return false;
+	}
+	memset(buffer,0,sizeof(struct aesd_lockfree_buffer));
+	for(i=0;i<count;i++){
+		atomic_init(&slots[i].seq,i);
+		memset(&slots[i].entry,0,sizeof(struct aesd_buffer_entry));
+	}
+	atomic_init(&buffer->head,0);
+	buffer->slot=slots;
+	buffer->mask=count-1;
+	buffer->multi_producer=multi_producer;
+	return true;
+}
+
+/**
+* Adds entry @param add_entry to @param buffer without taking a lock.  Only one thread may call it at a time unless the
+* buffer was initialized for several producers.
+* Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller,
+* the consumer frees it once aesd_lockfree_buffer_remove_oldest hands the entry back.
+* @return false if the buffer is full, nothing is added then
+*/
+bool aesd_lockfree_buffer_add_entry(struct aesd_lockfree_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+{
+	size_t position=atomic_load_explicit(&buffer->head,memory_order_relaxed);
+	struct aesd_lockfree_slot *slot;
+
+	for(;;){
+		slot=&(buffer->slot[indexing(buffer,position)]);
+		size_t seq=atomic_load_explicit(&slot->seq,memory_order_acquire);
+		if(seq!=position){
+			if((ptrdiff_t)(seq-position)<0){    //The consumer has not taken out the entry from one lap ago
+				return false;
+			}
+			position=atomic_load_explicit(&buffer->head,memory_order_relaxed);    //Another producer claimed it first
+			continue;
+		}
+		if(!buffer->multi_producer){
+			atomic_store_explicit(&buffer->head,position+1,memory_order_relaxed);
+			break;
+		}
+		if(atomic_compare_exchange_weak_explicit(&buffer->head,&position,position+1,
+					memory_order_relaxed,memory_order_relaxed)){
+			break;
+		}
+	}
+	slot->entry.buffptr=add_entry->buffptr;
+	slot->entry.size=add_entry->size;
+	atomic_store_explicit(&slot->seq,position+1,memory_order_release);
+	return true;
+}
+
+/**
+ * @return the entry at @param position if it has been published and not taken out yet, NULL otherwise.
+ * Only the consumer may call it.
+ */
+struct aesd_buffer_entry *aesd_lockfree_buffer_published(struct aesd_lockfree_buffer *buffer, size_t position)
+{
+	struct aesd_lockfree_slot *slot=&(buffer->slot[indexing(buffer,position)]);
+
+	if(position-buffer->tail>buffer->mask ||
+			atomic_load_explicit(&slot->seq,memory_order_acquire)!=position+1){
+		return NULL;
+	}
+	return &(slot->entry);
+}
+
+/**
+ * Extends the entries visible to the consumer over the ones published since, giving each its start
+ */
+static void aesd_lockfree_buffer_refresh(struct aesd_lockfree_buffer *buffer)
+{
+	struct aesd_buffer_entry *entry;
+
+	while((entry=aesd_lockfree_buffer_published(buffer,buffer->visible))!=NULL){
+		entry->start=buffer->end;
+		buffer->end+=entry->size;
+		buffer->total_size+=entry->size;
+		buffer->visible++;
+	}
+}
+
+/**
+ * @return the number of entries visible to the consumer, after taking in the ones published since the last call.
+ * Only the consumer may call it.
+ */
+uint32_t aesd_lockfree_buffer_count(struct aesd_lockfree_buffer *buffer)
+{
+	aesd_lockfree_buffer_refresh(buffer);
+	return buffer->visible-buffer->tail;
+}
+
+/**
+ * Same as aesd_circular_buffer_find_entry_offset_for_fpos, over the entries published so far.
+ * Only the consumer may call it, the entry returned stays valid until the consumer takes it out.
+ */
+struct aesd_buffer_entry *aesd_lockfree_buffer_find_entry_offset_for_fpos(struct aesd_lockfree_buffer *buffer,
+            size_t char_offset, size_t *entry_offset_byte_rtn)
+{
+	size_t low=0, high, first;
+
+	high=aesd_lockfree_buffer_count(buffer);
+	if(char_offset>=buffer->total_size){
+		return NULL;
+	}
+	first=buffer->slot[indexing(buffer,buffer->tail)].entry.start;
+	while(high-low>1){                      //Find the newest entry starting at or before char_offset
+		size_t mid=low+(high-low)/2;
+		if(buffer->slot[indexing(buffer,buffer->tail+mid)].entry.start-first<=char_offset){
+			low=mid;
+		}
+		else{
+			high=mid;
+		}
+	}
+	struct aesd_buffer_entry *entry=&(buffer->slot[indexing(buffer,buffer->tail+low)].entry);
+	*entry_offset_byte_rtn=char_offset-(entry->start-first);
+	return entry;
+}
+
+/**
+* Takes the oldest published entry out of @param buffer, copying it to @param removed when that is not NULL, and
+* frees its slot for the producers.  Only the consumer may call it.
+* @return false if no entry has been published
+*/
+bool aesd_lockfree_buffer_remove_oldest(struct aesd_lockfree_buffer *buffer, struct aesd_buffer_entry *removed)
+{
+	struct aesd_lockfree_slot *slot;
+
+	if(aesd_lockfree_buffer_count(buffer)==0){
+		return false;
+	}
+	slot=&(buffer->slot[indexing(buffer,buffer->tail)]);
+	if(removed){
+		*removed=slot->entry;
+	}
+	buffer->total_size-=slot->entry.size;
+	atomic_store_explicit(&slot->seq,buffer->tail+buffer->mask+1,memory_order_release);
+	buffer->tail++;
+	return true;
+}
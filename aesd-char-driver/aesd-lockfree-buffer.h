@@ -0,0 +1,116 @@
+/*
+ * aesd-lockfree-buffer.h
+ *
+ *  Lock-free variant of the circular buffer in aesd-circular-buffer.h for
+ *  userspace, built on C11 atomics. Producer threads add entries without a
+ *  lock, either one producer or any number of them, and a single consumer
+ *  thread looks entries up by position and takes the oldest ones out.
+ *  Unlike aesd_circular_buffer, a full buffer refuses new entries rather
+ *  than overwriting the oldest one, since only the consumer knows when an
+ *  entry's memory is no longer in use.
+ */
+
+#ifndef AESD_LOCKFREE_BUFFER_H
+#define AESD_LOCKFREE_BUFFER_H
+
+#ifdef __KERNEL__
+#error "aesd-lockfree-buffer is userspace only, the driver locks aesd_circular_buffer instead"
+#endif
+
+#include <stdatomic.h>
+#include <stddef.h> // size_t
+#include <stdint.h> // uintx_t
+#include <stdbool.h>
+#include "aesd-circular-buffer.h"
+
+/**
+ * Size assumed for a cache line, the producer and consumer indices are kept this far apart
+ */
+#define AESD_CACHE_LINE 64
+
+/**
+ * One entry of the buffer with the sequence number that hands it between producers and the consumer
+ */
+struct aesd_lockfree_slot
+{
+    /**
+     * Position the slot is free for while it equals that position, the position plus one once the entry
+     * stored there has been published
+     */
+    atomic_size_t seq;
+    struct aesd_buffer_entry entry;
+};
+
+struct aesd_lockfree_buffer
+{
+    /**
+     * Fields below are set by aesd_lockfree_buffer_init and only read after, by producers and consumer alike, so
+     * they get a line of their own that the writes to head and to the consumer fields never invalidate
+     * Storage given to aesd_lockfree_buffer_init, a power of two slots long
+     */
+    _Alignas(AESD_CACHE_LINE) struct aesd_lockfree_slot *slot;
+    /**
+     * Number of slots minus one
+     */
+    size_t mask;
+    /**
+     * Set when more than one thread may call aesd_lockfree_buffer_add_entry at once
+     */
+    bool multi_producer;
+    /**
+     * Position the next entry is added at, claimed with a compare and swap when there are several producers
+     */
+    _Alignas(AESD_CACHE_LINE) atomic_size_t head;
+    /**
+     * Fields below are only used by the consumer
+     * Position of the oldest entry
+     */
+    _Alignas(AESD_CACHE_LINE) size_t tail;
+    /**
+     * Position after the newest entry the consumer has seen published, entries before it have their start set
+     */
+    size_t visible;
+    /**
+     * Bytes held by the entries from tail to visible
+     */
+    size_t total_size;
+    /**
+     * Bytes seen by the consumer since the buffer was initialized, the start of the next visible entry
+     */
+    size_t end;
+};
+
+extern bool aesd_lockfree_buffer_init(struct aesd_lockfree_buffer *buffer, struct aesd_lockfree_slot *slots,
+            size_t count, bool multi_producer);
+
+extern bool aesd_lockfree_buffer_add_entry(struct aesd_lockfree_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+
+extern struct aesd_buffer_entry *aesd_lockfree_buffer_published(struct aesd_lockfree_buffer *buffer, size_t position);
+
+extern uint32_t aesd_lockfree_buffer_count(struct aesd_lockfree_buffer *buffer);
+
+extern struct aesd_buffer_entry *aesd_lockfree_buffer_find_entry_offset_for_fpos(struct aesd_lockfree_buffer *buffer,
+            size_t char_offset, size_t *entry_offset_byte_rtn);
+
+extern bool aesd_lockfree_buffer_remove_oldest(struct aesd_lockfree_buffer *buffer, struct aesd_buffer_entry *removed);
+
+/**
+ * Create a for loop to iterate over the entries published to the buffer, oldest first.  Only the consumer may use it.
+ * Useful when the producers have stopped and the memory of the entries needs to be freed
+ * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
+ * @param buffer is the struct aesd_lockfree_buffer * describing the buffer
+ * @param index is a size_t stack allocated value used by this macro for a position
+ * Example usage:
+ * size_t index;
+ * struct aesd_lockfree_buffer buffer;
+ * struct aesd_buffer_entry *entry;
+ * AESD_LOCKFREE_BUFFER_FOREACH(entry,&buffer,index) {
+ *      free(entry->buffptr);
+ * }
+ */
+#define AESD_LOCKFREE_BUFFER_FOREACH(entryptr,buffer,index) \
+    for(index=(buffer)->tail; \
+            (entryptr=aesd_lockfree_buffer_published((buffer),index))!=NULL; \
+            index++)
+
+#endif /* AESD_LOCKFREE_BUFFER_H */
@@ -33,14 +33,87 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Header at the start of an aesdchar mapping, when the module is loaded with log_size set.  The data follows at
+ * data_offset, mapped twice back to back, so the byte at position p is at data_offset + (p & (data_size - 1)) and
+ * up to data_size bytes from there are contiguous.  Positions only grow.  Bytes between head and tail are the
+ * history; a copy of [start, end) is intact if head is still at or before start once it is taken.
+ */
+struct aesd_mmap_header {
+    /**
+     * Position of the oldest byte kept
+     */
+    uint64_t head;
+    /**
+     * Position one past the newest byte
+     */
+    uint64_t tail;
+    /**
+     * Number of writes added to the log, changes whenever tail does
+     */
+    uint64_t generation;
+    /**
+     * Offset of the data from the start of the mapping, one page
+     */
+    uint32_t data_offset;
+    /**
+     * Bytes of data in the log, a power of two
+     */
+    uint32_t data_size;
+};
+
+/**
+ * The bytes a device holds, filled in by AESDCHAR_IOCGETRANGE.  Positions count every byte written since the device
+ * was set up, so unlike a file offset a position keeps naming the same byte while older writes are dropped
+ */
+struct aesd_range {
+    /**
+     * Position of the oldest byte kept, file offset 0
+     */
+    uint64_t start;
+    /**
+     * Position one past the newest byte
+     */
+    uint64_t end;
+    /**
+     * Nonzero value picked when the device is set up, positions from a different one name other bytes
+     */
+    uint64_t epoch;
+};
+
+/**
+ * File offset of the byte at @param position in @param range, or -1 if that byte has been dropped or position is
+ * past the end.  The end itself translates to the size of the device
+ */
+static inline int64_t aesd_range_offset(const struct aesd_range *range, uint64_t position)
+{
+    if (position < range->start || position > range->end) {
+        return -1;
+    }
+    return (int64_t) (position - range->start);
+}
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Set how many writes the device keeps, dropping the oldest if it shrinks, use command number 2
+#define AESDCHAR_IOCSETCAPACITY _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+// Read how many writes the device keeps, use command number 3
+#define AESDCHAR_IOCGETCAPACITY _IOR(AESD_IOC_MAGIC, 3, uint32_t)
+// Set the total bytes of writes the device keeps, 0 for no limit, use command number 4
+#define AESDCHAR_IOCSETMAXBYTES _IOW(AESD_IOC_MAGIC, 4, uint64_t)
+// Read the total bytes of writes the device keeps, use command number 5
+#define AESDCHAR_IOCGETMAXBYTES _IOR(AESD_IOC_MAGIC, 5, uint64_t)
+// Make reads on this file follow new writes when nonzero: at the end they block, or fail with EAGAIN under
+// O_NONBLOCK, and they continue where the last one stopped even as older writes are dropped, use command number 6
+#define AESDCHAR_IOCTAIL _IOW(AESD_IOC_MAGIC, 6, uint32_t)
+// Read the positions of the bytes the device holds and its epoch, use command number 7
+#define AESDCHAR_IOCGETRANGE _IOR(AESD_IOC_MAGIC, 7, struct aesd_range)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 7
 
 #endif /* AESD_IOCTL_H */
@@ -0,0 +1,170 @@
+/*
+ * aesdchar-read-bench.c
+ *
+ *  Userspace read benchmark for the aesdchar driver. Writes a number of
+ *  newline terminated entries to the device, then reads the whole history
+ *  back from offset 0 over and over with a fixed size user buffer, and
+ *  reports the read() calls needed per pass and the throughput. With -m the
+ *  history is copied out of an mmap of the device instead, which needs the
+ *  module loaded with log_size set; copies overtaken by writers are counted
+ *  and retried.
+ *
+ *  Usage: aesdchar-read-bench [-d device] [-e entries] [-s entry size] [-b read size] [-t seconds] [-m]
+ *
+ *  Entries beyond what the driver keeps evict the oldest, so -e above the
+ *  ring capacity measures a full ring. Any regular file can stand in for
+ *  the device to check the tool itself.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "aesd_ioctl.h"
+
+static double nowSeconds(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Copy the history out of an aesdchar mapping in read size pieces, as a reader would stream it
+ * @return the bytes copied, after restarting the pass when writers overtook it
+ */
+static off_t mmapPass(struct aesd_mmap_header *header, char *buf, long read_size, unsigned long long *copies,
+                      unsigned long long *overruns){
+    const char *data = (const char *) header + header->data_offset;
+    uint64_t mask = header->data_size - 1;
+
+restart:;
+    uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+    uint64_t start = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    for (uint64_t pos = start; pos < tail; pos += read_size) {
+        size_t len = tail - pos < (uint64_t) read_size ? tail - pos : (size_t) read_size;
+        memcpy(buf, data + (pos & mask), len);
+        (*copies)++;
+        if (__atomic_load_n(&header->head, __ATOMIC_ACQUIRE) > pos) {    //Overwritten while copying
+            (*overruns)++;
+            goto restart;
+        }
+    }
+    return tail - start;
+}
+
+int main(int argc, char *argv[]){
+    const char *device = "/dev/aesdchar";
+    long entries = 10, entry_size = 64, read_size = 65536;
+    double duration = 2;
+    int use_mmap = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:e:s:b:t:m")) != -1) {
+        switch (opt) {
+        case 'd': device = optarg; break;
+        case 'e': entries = atol(optarg); break;
+        case 's': entry_size = atol(optarg); break;
+        case 'b': read_size = atol(optarg); break;
+        case 't': duration = atof(optarg); break;
+        case 'm': use_mmap = 1; break;
+        default:
+            fprintf(stderr, "Usage: %s [-d device] [-e entries] [-s entry size] [-b read size] [-t seconds] [-m]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (entries < 0 || entry_size < 1 || read_size < 1) {
+        fprintf(stderr, "Entries, entry size and read size must be positive\n");
+        return 1;
+    }
+
+    char *entry = malloc(entry_size);
+    char *buf = malloc(read_size);
+    if (entry == NULL || buf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    int fd = open(device, O_RDWR);
+    if (fd == -1) {
+        fprintf(stderr, "Cannot open %s: %s\n", device, strerror(errno));
+        return 1;
+    }
+    for (long i = 0; i < entries; i++) {
+        memset(entry, 'a' + i % 26, entry_size - 1);
+        entry[entry_size - 1] = '\n';
+        if (write(fd, entry, entry_size) != entry_size) {
+            fprintf(stderr, "Write to %s failed: %s\n", device, strerror(errno));
+            return 1;
+        }
+    }
+
+    struct aesd_mmap_header *header = NULL;
+    size_t map_len = 0;
+    unsigned long long overruns = 0;
+    if (use_mmap) {
+        long page = sysconf(_SC_PAGESIZE);
+        header = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);      //The header gives the size of the whole mapping
+        if (header == MAP_FAILED) {
+            fprintf(stderr, "Cannot mmap %s: %s\n", device, strerror(errno));
+            return 1;
+        }
+        if (header->data_offset != page || header->data_size == 0 || (header->data_size & (header->data_size - 1))) {
+            fprintf(stderr, "%s does not map an aesdchar log\n", device);
+            return 1;
+        }
+        map_len = header->data_offset + 2 * (size_t) header->data_size;
+        munmap(header, page);
+        header = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+        if (header == MAP_FAILED) {
+            fprintf(stderr, "Cannot mmap %s: %s\n", device, strerror(errno));
+            return 1;
+        }
+    }
+
+    unsigned long long passes = 0, reads = 0, bytes = 0;
+    double start = nowSeconds(), elapsed;
+    do {
+        if (use_mmap) {
+            bytes += mmapPass(header, buf, read_size, &reads, &overruns);
+            passes++;
+            elapsed = nowSeconds() - start;
+            continue;
+        }
+        off_t offset = 0;
+        ssize_t bytes_read;
+        while ((bytes_read = pread(fd, buf, read_size, offset)) > 0) {
+            offset += bytes_read;
+            reads++;
+        }
+        if (bytes_read == -1) {
+            fprintf(stderr, "Read from %s failed: %s\n", device, strerror(errno));
+            return 1;
+        }
+        reads++;    //The read that returned end of file is part of every pass
+        bytes += offset;
+        passes++;
+        elapsed = nowSeconds() - start;
+    } while (elapsed < duration);
+
+    printf("device:          %s\n", device);
+    printf("entries written: %ld of %ld bytes\n", entries, entry_size);
+    printf("read size:       %ld%s\n", read_size, use_mmap ? " copied from the mapping" : "");
+    printf("history:         %llu bytes\n", passes ? bytes / passes : 0);
+    printf("reads per pass:  %.1f\n", (double) reads / passes);
+    printf("passes/sec:      %.0f\n", passes / elapsed);
+    printf("throughput:      %.1f MB/s\n", bytes / elapsed / 1e6);
+    if (use_mmap) {
+        printf("overruns:        %llu\n", overruns);
+        munmap(header, map_len);
+    }
+
+    close(fd);
+    free(buf);
+    free(entry);
+    return 0;
+}
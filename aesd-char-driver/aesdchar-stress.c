@@ -0,0 +1,205 @@
+/*
+ * aesdchar-stress.c
+ *
+ *  Multi-threaded stress test for the aesdchar driver. Writer threads, each
+ *  with its own open file, write numbered commands split into a number of
+ *  write() calls while reader threads read the history back from offset 0.
+ *  Every complete command a reader sees must be one writer's command,
+ *  unmixed with any other, and each writer's commands must appear in the
+ *  order they were written. Runs once per writer count given with -w and
+ *  reports the command and read rates, so scaling with writers shows up
+ *  in one table. With several devices, writers and readers are spread
+ *  over them in turn, to compare sharding against one shared device.
+ *
+ *  Usage: aesdchar-stress [-d device[,device...]] [-w writers[,writers...]] [-r readers] [-s command size] [-p pieces]
+ *                         [-b read size] [-t seconds]
+ *
+ *  The exit status is non-zero if any command was seen corrupted or out of
+ *  order. A regular file can stand in for the device to check the tool
+ *  itself when -p is 1.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_WRITERS 256
+#define MAX_DEVICES 64
+
+static const char *devices[MAX_DEVICES] = { "/dev/aesdchar" };
+static int device_count = 1;
+static long command_size = 64, pieces = 1, read_size = 1 << 20;
+static atomic_bool stop;
+static atomic_ullong commands_written, bytes_read, corrupt, out_of_order;
+
+static double nowSeconds(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int openDevice(const char *device, int flags){
+    int fd = open(device, flags);
+    if (fd == -1) {
+        fprintf(stderr, "Cannot open %s: %s\n", device, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+/*
+ * Commands are "<writer>:<sequence>:" padded to command_size with a letter picked by the writer
+ */
+static void *writerRoutine(void *arg){
+    long id = (long) arg;
+    const char *device = devices[id % device_count];
+    char *command = malloc(command_size);
+    int fd = openDevice(device, O_WRONLY | O_APPEND);
+
+    for (unsigned long seq = 0; !atomic_load_explicit(&stop, memory_order_relaxed); seq++) {
+        int len = snprintf(command, command_size, "%ld:%lu:", id, seq);
+        memset(command + len, 'a' + id % 26, command_size - 1 - len);
+        command[command_size - 1] = '\n';
+        for (long piece = 0; piece < pieces; piece++) {
+            long offset = piece * command_size / pieces;
+            long piece_len = (piece + 1) * command_size / pieces - offset;
+            if (write(fd, command + offset, piece_len) != piece_len) {
+                fprintf(stderr, "Write to %s failed: %s\n", device, strerror(errno));
+                exit(1);
+            }
+        }
+        atomic_fetch_add_explicit(&commands_written, 1, memory_order_relaxed);
+    }
+    close(fd);
+    free(command);
+    return NULL;
+}
+
+/*
+ * Check the complete commands in one read, which the driver returns from a single consistent view.
+ * The first fragment is skipped when the read did not start at offset 0
+ */
+static void checkChunk(const char *chunk, size_t len, int at_start){
+    long last_seq[MAX_WRITERS];
+    const char *line = chunk, *end = chunk + len, *newline;
+
+    memset(last_seq, -1, sizeof(last_seq));
+    if (!at_start) {
+        newline = memchr(line, '\n', len);
+        line = newline ? newline + 1 : end;
+    }
+    while (line < end && (newline = memchr(line, '\n', end - line)) != NULL) {
+        long id, seq;
+        int consumed;
+        int ok = sscanf(line, "%ld:%ld:%n", &id, &seq, &consumed) == 2 && id >= 0 && id < MAX_WRITERS &&
+                 newline - line + 1 == command_size;
+        for (const char *c = line + (ok ? consumed : 0); ok && c < newline; c++) {
+            ok = *c == 'a' + id % 26;
+        }
+        if (!ok) {
+            atomic_fetch_add_explicit(&corrupt, 1, memory_order_relaxed);
+        } else if (seq <= last_seq[id]) {
+            atomic_fetch_add_explicit(&out_of_order, 1, memory_order_relaxed);
+        } else {
+            last_seq[id] = seq;
+        }
+        line = newline + 1;
+    }
+}
+
+static void *readerRoutine(void *arg){
+    const char *device = devices[(long) arg % device_count];
+    char *buf = malloc(read_size);
+    int fd = openDevice(device, O_RDONLY);
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        off_t offset = 0;
+        ssize_t bytes;
+        while ((bytes = pread(fd, buf, read_size, offset)) > 0 && !atomic_load_explicit(&stop, memory_order_relaxed)) {
+            checkChunk(buf, bytes, offset == 0);
+            offset += bytes;
+        }
+        if (bytes == -1) {
+            fprintf(stderr, "Read from %s failed: %s\n", device, strerror(errno));
+            exit(1);
+        }
+        atomic_fetch_add_explicit(&bytes_read, offset, memory_order_relaxed);
+    }
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+int main(int argc, char *argv[]){
+    char *writer_list = "1,2,4,8";
+    long readers = 2;
+    double duration = 2;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:w:r:s:p:b:t:")) != -1) {
+        switch (opt) {
+        case 'd':
+            device_count = 0;
+            for (char *item = strtok(optarg, ","); item != NULL && device_count < MAX_DEVICES; item = strtok(NULL, ",")) {
+                devices[device_count++] = item;
+            }
+            break;
+        case 'w': writer_list = optarg; break;
+        case 'r': readers = atol(optarg); break;
+        case 's': command_size = atol(optarg); break;
+        case 'p': pieces = atol(optarg); break;
+        case 'b': read_size = atol(optarg); break;
+        case 't': duration = atof(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-d device[,device...]] [-w writers[,writers...]] [-r readers] [-s command size] [-p pieces]"
+                    " [-b read size] [-t seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (device_count == 0 || readers < 0 || command_size < 24 || pieces < 1 || pieces > command_size || read_size < command_size) {
+        fprintf(stderr, "Command size must be at least 24, pieces 1 to the command size, read size at least the command size\n");
+        return 1;
+    }
+
+    printf("%8s %8s %14s %12s %10s %12s\n", "writers", "readers", "commands/sec", "read MB/s", "corrupt", "out of order");
+    unsigned long long failures = 0;
+    for (char *item = strtok(writer_list, ","); item != NULL; item = strtok(NULL, ",")) {
+        long writers = atol(item);
+        if (writers < 1 || writers > MAX_WRITERS) {
+            fprintf(stderr, "Writer count must be 1 to %d\n", MAX_WRITERS);
+            return 1;
+        }
+        pthread_t threads[MAX_WRITERS + readers];
+        atomic_store(&stop, 0);
+        atomic_store(&commands_written, 0);
+        atomic_store(&bytes_read, 0);
+        atomic_store(&corrupt, 0);
+        atomic_store(&out_of_order, 0);
+
+        double start = nowSeconds();
+        for (long i = 0; i < writers + readers; i++) {
+            if (pthread_create(&threads[i], NULL, i < writers ? writerRoutine : readerRoutine,
+                               (void *) (i < writers ? i : i - writers)) != 0) {
+                perror("pthread_create");
+                return 1;
+            }
+        }
+        usleep(duration * 1e6);
+        atomic_store(&stop, 1);
+        for (long i = 0; i < writers + readers; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        double elapsed = nowSeconds() - start;
+
+        printf("%8ld %8ld %14.0f %12.1f %10llu %12llu\n", writers, readers, atomic_load(&commands_written) / elapsed,
+               atomic_load(&bytes_read) / elapsed / 1e6, atomic_load(&corrupt), atomic_load(&out_of_order));
+        failures += atomic_load(&corrupt) + atomic_load(&out_of_order);
+    }
+    return failures != 0;
+}
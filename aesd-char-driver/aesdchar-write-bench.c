@@ -0,0 +1,140 @@
+/*
+ * aesdchar-write-bench.c
+ *
+ *  Userspace write benchmark for the aesdchar driver. Writes a number of
+ *  newline terminated commands to the device, each split into a number of
+ *  write() calls, and reports the latency per write() and per command and
+ *  the driver allocations per command, read from the module's allocations
+ *  parameter. With -v the pieces of that many commands are passed to one
+ *  writev() call instead, the latency of a call then covering all of them.
+ *
+ *  Usage: aesdchar-write-bench [-d device] [-n commands] [-s command size] [-p pieces] [-v commands per writev]
+ *
+ *  Any regular file can stand in for the device to check the tool itself,
+ *  the allocation count is then reported as unavailable.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ALLOCATIONS_PARAM "/sys/module/aesdchar/parameters/allocations"
+#define MAX_IOV 1024    //Segments Linux takes in one writev
+
+static double nowSeconds(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long readAllocations(){
+    long value = -1;
+    FILE *param = fopen(ALLOCATIONS_PARAM, "r");
+    if (param != NULL) {
+        if (fscanf(param, "%ld", &value) != 1) value = -1;
+        fclose(param);
+    }
+    return value;
+}
+
+static int compareDouble(const void *a, const void *b){
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]){
+    const char *device = "/dev/aesdchar";
+    long commands = 100000, command_size = 64, pieces = 1, vector = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:s:p:v:")) != -1) {
+        switch (opt) {
+        case 'd': device = optarg; break;
+        case 'n': commands = atol(optarg); break;
+        case 's': command_size = atol(optarg); break;
+        case 'p': pieces = atol(optarg); break;
+        case 'v': vector = atol(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-d device] [-n commands] [-s command size] [-p pieces] [-v commands per writev]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (commands < 1 || command_size < 1 || pieces < 1 || pieces > command_size || vector < 0 || vector * pieces > MAX_IOV) {
+        fprintf(stderr, "Commands and command size must be positive, pieces 1 to the command size, at most %d pieces per writev\n", MAX_IOV);
+        return 1;
+    }
+
+    char *command = malloc(command_size);
+    double *latency = malloc(commands * sizeof(double));
+    if (command == NULL || latency == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    memset(command, 'w', command_size - 1);
+    command[command_size - 1] = '\n';
+
+    int fd = open(device, O_WRONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Cannot open %s: %s\n", device, strerror(errno));
+        return 1;
+    }
+
+    struct iovec iov[MAX_IOV];
+    for (long i = 0; i < vector * pieces; i++) {
+        long piece = i % pieces, offset = piece * command_size / pieces;
+        iov[i].iov_base = command + offset;
+        iov[i].iov_len = (piece + 1) * command_size / pieces - offset;
+    }
+
+    long allocations = readAllocations();
+    long calls = 0;
+    double start = nowSeconds();
+    for (long i = 0; i < commands; ) {
+        double command_start = nowSeconds();
+        if (vector) {
+            long batch = commands - i < vector ? commands - i : vector;
+            ssize_t len = batch * command_size;
+            if (writev(fd, iov, batch * pieces) != len) {
+                fprintf(stderr, "Writev to %s failed: %s\n", device, strerror(errno));
+                return 1;
+            }
+            calls++;
+            for (long done = i + batch; i < done; i++) latency[i] = nowSeconds() - command_start;
+            continue;
+        }
+        for (long piece = 0; piece < pieces; piece++) {
+            long offset = piece * command_size / pieces;
+            long len = (piece + 1) * command_size / pieces - offset;
+            if (write(fd, command + offset, len) != len) {
+                fprintf(stderr, "Write to %s failed: %s\n", device, strerror(errno));
+                return 1;
+            }
+            calls++;
+        }
+        latency[i++] = nowSeconds() - command_start;
+    }
+    double elapsed = nowSeconds() - start;
+    if (allocations != -1) allocations = readAllocations() - allocations;
+
+    qsort(latency, commands, sizeof(double), compareDouble);
+    printf("device:            %s\n", device);
+    printf("commands:          %ld of %ld bytes in %ld pieces%s\n", commands, command_size, pieces,
+           vector ? ", gathered with writev" : "");
+    printf("per call:          %.0f ns over %ld calls\n", elapsed * 1e9 / calls, calls);
+    printf("per command:       %.0f ns mean, %.0f ns p50, %.0f ns p99 call latency\n", elapsed * 1e9 / commands,
+           latency[commands / 2] * 1e9, latency[(long) (commands * 0.99)] * 1e9);
+    if (allocations != -1)
+        printf("allocations:       %.2f per command\n", (double) allocations / commands);
+    else
+        printf("allocations:       unavailable, %s not readable\n", ALLOCATIONS_PARAM);
+
+    close(fd);
+    free(latency);
+    free(command);
+    return 0;
+}
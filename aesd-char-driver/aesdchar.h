@@ -5,7 +5,10 @@
  *      Author: Dan Walkes
  */
 #include "aesd-circular-buffer.h"
+#include "aesd_ioctl.h"
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/wait.h>
 #include <linux/cdev.h>
 
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
@@ -29,11 +32,30 @@
 struct aesd_dev
 {
     struct aesd_circular_buffer buff;
-    char *partial_write;
-    size_t partial_len;
-    struct mutex writeLock;
+    struct rw_semaphore buffLock;   // Shared by readers, held exclusively to change buff
+    wait_queue_head_t readQueue;    // Woken when a write is added to buff
+    struct page **log_pages;        // Header page then data pages of the mmap-able log, NULL without one
+    char *log_data;                 // Data pages mapped in the kernel, the ring of buff when set
+    struct aesd_mmap_header *log_header;
+    size_t log_size;                // Bytes of data in the log, a power of two pages
+    u64 epoch;                      // Reported by AESDCHAR_IOCGETRANGE, positions restart whenever the device is set up
     struct cdev chardev;     // Character device structure
 };
 
+/*
+ * State of one open file, kept in filp->private_data
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    struct mutex partialLock;   // Guards the partial command when threads share the file
+    char *partial_write;     // Command written so far through this file, waiting for its newline
+    size_t partial_len;
+    size_t partial_cap;      // Bytes allocated for partial_write
+    bool tail;               // Reads block at the end and follow new writes, set with AESDCHAR_IOCTAIL
+    size_t tail_pos;         // Bytes written to the device before where the last read stopped
+    loff_t tail_fpos;        // f_pos the last read left, a different one means the file was seeked
+};
+
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
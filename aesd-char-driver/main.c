@@ -18,7 +18,17 @@
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h>
+#include <linux/atomic.h>
+#include <linux/mm.h>     // kvcalloc, kvfree
+#include <linux/log2.h>
 #include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>       // iov_iter
+#include <linux/vmalloc.h>   // vmap, vunmap
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/random.h>
 #include "aesd_ioctl.h"
 #include "aesdchar.h"
 #include "aesd-circular-buffer.h"
@@ -26,247 +36,808 @@
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
+static uint devices = 1;                                           //Minors created, each with its own history and lock
+module_param(devices, uint, S_IRUGO);
+MODULE_PARM_DESC(devices, "Number of aesdchar devices, up to 64 (default 1)");
+#define AESD_MAX_DEVICES 64
+
+static uint capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;    //Writes kept before the oldest is dropped
+module_param(capacity, uint, S_IRUGO);
+MODULE_PARM_DESC(capacity, "Number of writes the device keeps, up to 1048576 (default 10)");
+
+static ulong max_bytes = 0;                                        //Bytes kept before the oldest writes are dropped
+module_param(max_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(max_bytes, "Total bytes the device keeps, 0 for no limit (default 0)");
+
+static ulong log_size = 0;                                         //Bytes of mmap-able log, 0 to keep writes in separate allocations
+module_param(log_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(log_size, "Bytes of mmap-able log the history is kept in, rounded up to a power of two pages up to 1 GiB, 0 to disable (default 0)");
+#define AESD_MAX_LOG_SIZE (1UL << 30)
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+#define vm_flags_clear(vma, flags) ((vma)->vm_flags &= ~(flags))
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 5, 0)
+#define copy_splice_read generic_file_splice_read                 //Both splice through read_iter, renamed in 6.5
+#endif
+
+#define AESD_WRITE_BATCH 16                                       //Commands added under one acquisition of buffLock
+#define AESD_SMALL_RECORD 256                                     //Writes up to this size come from aesd_record_cache
+static struct kmem_cache *aesd_record_cache;
+
+static atomic_long_t allocations = ATOMIC_LONG_INIT(0);            //Allocations made by the write path, for benchmarking
+static int aesd_get_allocations(char *buffer, const struct kernel_param *kp){
+    return scnprintf(buffer, PAGE_SIZE, "%ld\n", atomic_long_read(&allocations));
+}
+static const struct kernel_param_ops allocations_ops = {
+    .get = aesd_get_allocations,
+};
+module_param_cb(allocations, &allocations_ops, NULL, S_IRUGO);
+MODULE_PARM_DESC(allocations, "Allocations made by writes since the module was loaded (read only)");
+
 MODULE_AUTHOR("Logan Ingram");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices;                                     //One for each minor, from aesd_minor up
 
 int aesd_open(struct inode *inode, struct file *filp){
 
     PDEBUG("open");
 
-    struct aesd_dev *dev = NULL;                                        //Declare the device struct and set it to NULL so its not some random address
-    struct aesd_buffer_entry *entry;
-    uint8_t index;
-    
-    dev = container_of(inode->i_cdev, struct aesd_dev, chardev);        //Figure out how long each piece is based on the size of the struct
-    filp->private_data = dev;
+    struct aesd_file *file = NULL;
 
-    PDEBUG("Open current buffer content");
-	AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buff, index){
-    	if (entry->buffptr){
-            
-    		PDEBUG("Opened at: %s", entry->buffptr);
-    	}
+    file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);              //Every open file builds up its own partial command
+    if (file == NULL){
+        return -ENOMEM;
     }
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, chardev);  //Figure out how long each piece is based on the size of the struct
+    mutex_init(&(file->partialLock));
+    filp->private_data = file;
     return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp){
 
-    PDEBUG("release");
-
-    struct aesd_dev *dev = NULL;
-    struct aesd_buffer_entry *entry;
-    uint8_t index;
-    dev = container_of(inode->i_cdev, struct aesd_dev, chardev);
-  
-    if (mutex_is_locked(&(dev->writeLock))){                     //Check if the mutex is already locked and if so, release it
+    struct aesd_file *file = (struct aesd_file *) filp->private_data;
 
-    	mutex_unlock(&(dev->writeLock));
+    PDEBUG("release");
+    if (file->partial_len){
+        PDEBUG("Dropping %zu bytes of unterminated command", file->partial_len);
     }
-    
-    PDEBUG("Release current locked buffer");
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buff, index) {
-    	if (entry->buffptr){                                        
+    kvfree(file->partial_write);
+    mutex_destroy(&(file->partialLock));
+    kfree(file);
+    return 0;
+}
 
-    		PDEBUG("Mutex release entry %s", entry->buffptr);
-    	}
+/**
+ * For a file following new writes, move *@param f_pos to where the last read stopped, counted from the oldest write
+ * now kept, and wait until there is something to read there.  Returns 0 with buffLock held for reading
+ */
+static int aesd_tail_wait(struct aesd_file *file, struct kiocb *iocb, loff_t *f_pos){
+    struct aesd_dev *dev = file->dev;
+    size_t oldest, position;
+
+    for (;;){
+        if (down_read_killable(&(dev->buffLock))){
+            return -ERESTARTSYS;
+        }
+        oldest = dev->buff.end - dev->buff.total_size;
+        if (*f_pos == file->tail_fpos){                                 //Not moved with a seek since the last read
+            *f_pos = (file->tail_pos - oldest > dev->buff.total_size) ? 0 : file->tail_pos - oldest;  //Continue at the oldest write if the next one was dropped
+        }
+        if (*f_pos < dev->buff.total_size){
+            return 0;
+        }
+        position = oldest + *f_pos;
+        up_read(&(dev->buffLock));
+
+        if ((iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)){
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(dev->readQueue, READ_ONCE(dev->buff.end) != position)){
+            return -ERESTARTSYS;
+        }
     }
-
-    return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos){
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to){
 
-    struct aesd_dev *dev = (struct aesd_dev *) filp->private_data;
+    struct file *filp = iocb->ki_filp;
+    struct aesd_file *file = (struct aesd_file *) filp->private_data;
+    struct aesd_dev *dev = file->dev;
     struct aesd_buffer_entry *circBuf;
-    size_t received_bytes_offset, bytes_to_copy;
-    
+    struct aesd_circular_buffer_iter iter;
+    const char *span;
+    size_t received_bytes_offset, bytes_to_copy, bytes_copied;
+    size_t count = iov_iter_count(to);
+    loff_t *f_pos = &iocb->ki_pos;
+
     ssize_t retval = 0;
     PDEBUG("Read %ld bytes with offset %lld",count,*f_pos);
 
-    (void) mutex_lock_interruptible(&(dev->writeLock));                 //Type cast the mutex lock code because we dont use it
-    circBuf = aesd_circular_buffer_find_entry_offset_for_fpos(&(dev->buff), *f_pos, &received_bytes_offset);    //Save into
-    mutex_unlock(&(dev->writeLock));                                    //Release the mutex
+    if (file->tail){                                                    //Block at the end instead of returning 0
+        retval = aesd_tail_wait(file, iocb, f_pos);
+        if (retval){
+            return retval;
+        }
+    }
+    else if (down_read_killable(&(dev->buffLock))){                       //Entries stay in place until the lock is released, other readers share it
+        return -ERESTARTSYS;
+    }
+    if (dev->buff.ring != NULL){                                        //Writes kept in the log are contiguous, at most two copies cover any read
+        while ((size_t) retval < count && (bytes_to_copy = aesd_circular_buffer_span(&(dev->buff), *f_pos + retval, count - retval, &span)) != 0){
+            bytes_copied = copy_to_iter(span, bytes_to_copy, to);
+            retval += bytes_copied;
+            if (bytes_copied != bytes_to_copy){
+                if (retval == 0) retval = -EFAULT;
+                break;
+            }
+        }
+        circBuf = NULL;
+    }
+    else{
+        circBuf = aesd_circular_buffer_iter_fpos(&(dev->buff), *f_pos, &received_bytes_offset, &iter);
+    }
 
-    if (circBuf == NULL){                                                       //Check to see if there are any entries inside the circular buffer
-    	PDEBUG("No entry found to read");
-    	return 0;
+    while (circBuf != NULL && (size_t) retval < count){                                 //Fill the user buffers from as many consecutive entries as fit
+        bytes_to_copy = ((circBuf->size - received_bytes_offset) > (count - retval)) ? (count - retval) : (circBuf->size - received_bytes_offset);
+        bytes_copied = copy_to_iter(&circBuf->buffptr[received_bytes_offset], bytes_to_copy, to);
+        retval += bytes_copied;
+        if (bytes_copied != bytes_to_copy){                                     //Stop at a fault, reporting what was copied before it
+            if (retval == 0) retval = -EFAULT;
+            break;
+        }
+        received_bytes_offset = 0;                                              //Every entry after the first is read from its start
+        circBuf = aesd_circular_buffer_iter_next(&iter);
+    }
+    if (retval > 0){
+        *f_pos += retval;                       //Save the current position based on the returned number of characters
+    }
+    if (file->tail){                            //Remember where this read stopped in terms of bytes ever written
+        file->tail_pos = dev->buff.end - dev->buff.total_size + *f_pos;
+        file->tail_fpos = *f_pos;
     }
-    bytes_to_copy = ((circBuf->size - received_bytes_offset) > count) ? count : (circBuf->size - received_bytes_offset);    //Figure out the number of characters inside of the buffer
-    retval = bytes_to_copy - copy_to_user(buf, &circBuf->buffptr[received_bytes_offset], bytes_to_copy);        //Copy the characters to user space subtracting from the known number for error checking
-    *f_pos += retval;                           //Save the current position based on the returned number of characters
+    up_read(&(dev->buffLock));
     
     PDEBUG("Copied %ld bytes to user", retval);
     return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
-{
-    struct aesd_dev *dev = (struct aesd_dev *) filp->private_data;
-    struct aesd_buffer_entry *entry = NULL;
-    char *temp_buf;
+/**
+ * Allocate the storage for a completed write of @param size bytes, small ones from aesd_record_cache
+ */
+static char *aesd_alloc_record(size_t size){
+    atomic_long_inc(&allocations);
+    if (size <= AESD_SMALL_RECORD){
+        return kmem_cache_alloc(aesd_record_cache, GFP_KERNEL);
+    }
+    return kvmalloc(size, GFP_KERNEL);
+}
+
+/**
+ * Free a completed write, the allocator it came from follows from its size.  Writes kept in the log are
+ * simply overwritten later
+ */
+static void aesd_free_record(struct aesd_dev *dev, const char *buffptr, size_t size){
+    if (buffptr == NULL || dev->log_data != NULL){
+        return;
+    }
+    if (size <= AESD_SMALL_RECORD){
+        kmem_cache_free(aesd_record_cache, (void *) buffptr);
+    }
+    else{
+        kvfree(buffptr);
+    }
+}
+
+/**
+ * Publish the position of the oldest byte still kept, after entries were dropped.  buffLock must be held for writing
+ */
+static void aesd_log_update_head(struct aesd_dev *dev){
+    if (dev->log_data != NULL){
+        WRITE_ONCE(dev->log_header->head, dev->log_header->tail - dev->buff.total_size);
+    }
+}
 
-    ssize_t retval = -ENOMEM;
-    PDEBUG("Write %ld bytes with offset %lld",count,*f_pos);
+/**
+ * Add a completed write of @param size bytes at the end of the log, which is the ring of dev->buff.  The entries it
+ * overwrites must already be dropped with aesd_circular_buffer_evict_for.  buffLock must be held for writing
+ */
+static void aesd_log_append(struct aesd_dev *dev, const char *data, size_t size){
+    struct aesd_mmap_header *header = dev->log_header;
+
+    aesd_log_update_head(dev);
+    smp_wmb();                                                          //Mappings see the new head before the bytes under it change
+    aesd_circular_buffer_add_bytes(&(dev->buff), data, size);
+    smp_wmb();                                                          //and the bytes before the new tail
+    WRITE_ONCE(header->tail, dev->buff.end);
+    WRITE_ONCE(header->generation, header->generation + 1);
+}
 
-    temp_buf = (char *) kmalloc(count + dev->partial_len, GFP_KERNEL);   //Ask the kernel for a space for a new temporary buffer
-    if (dev->partial_write != NULL){                                    //If partial write isnt NULL then we know we append to our text
+/**
+ * Make room for @param needed bytes of partial write, at least doubling the buffer so a command arriving in
+ * many pieces is copied a bounded number of times
+ */
+static int aesd_partial_reserve(struct aesd_file *file, size_t needed){
+    char *grown;
+    size_t cap;
 
-    	strncpy(temp_buf, dev->partial_write, dev->partial_len);         //String copy from the passed in file temp buffer, and set it to the temporary buffer before we add text
+    if (needed <= file->partial_cap){
+        return 0;
     }
-    retval = count - copy_from_user(&temp_buf[dev->partial_len], buf, count);
+    cap = max_t(size_t, needed, max_t(size_t, file->partial_cap * 2, AESD_SMALL_RECORD));
+    grown = kvmalloc(cap, GFP_KERNEL);
+    if (grown == NULL){
+        return -ENOMEM;
+    }
+    atomic_long_inc(&allocations);
+    if (file->partial_len){
+        memcpy(grown, file->partial_write, file->partial_len);
+    }
+    kvfree(file->partial_write);
+    file->partial_write = grown;
+    file->partial_cap = cap;
+    return 0;
+}
 
-    if (temp_buf[count + dev->partial_len - 1] == '\n'){               //If we recieve a newline character then we know we got a full write text; Otherwise append
+/**
+ * Add the commands that end at @param ends in the partial buffer of @param file, the first starting at @param start,
+ * under one acquisition of buffLock.  A single command filling the whole partial buffer takes it over if it is large
+ * @return 0, or -ENOMEM with nothing added
+ */
+static int aesd_publish(struct aesd_file *file, size_t start, const size_t *ends, unsigned int count){
+    struct aesd_dev *dev = file->dev;
+    struct aesd_buffer_entry batch[AESD_WRITE_BATCH];
+    struct aesd_buffer_entry removed;
+    unsigned int i;
+
+    for (i = 0; i < count; i++){
+        batch[i].size = ends[i] - (i ? ends[i - 1] : start);
+        if (dev->log_data != NULL){                                     //Copied into the log once the lock is held
+            batch[i].buffptr = NULL;
+        }
+        else if (count == 1 && start == 0 && ends[0] == file->partial_len && batch[0].size > AESD_SMALL_RECORD){
+            batch[i].buffptr = file->partial_write;                     //Larger ones take the partial buffer over instead of copying it
+            file->partial_write = NULL;
+            file->partial_cap = 0;
+        }
+        else{
+            batch[i].buffptr = aesd_alloc_record(batch[i].size);
+            if (batch[i].buffptr == NULL){
+                while (i--){
+                    aesd_free_record(dev, batch[i].buffptr, batch[i].size);
+                }
+                return -ENOMEM;
+            }
+            memcpy((char *) batch[i].buffptr, &file->partial_write[ends[i] - batch[i].size], batch[i].size);
+        }
+    }
 
-    	PDEBUG("Writing %s to buffer", temp_buf);
-    	entry = (struct aesd_buffer_entry*) kmalloc(sizeof(struct aesd_buffer_entry), GFP_KERNEL);
-    	entry->buffptr = temp_buf;
-    	entry->size = dev->partial_len + count;
-    	(void) mutex_lock_interruptible(&(dev->writeLock));     //Type cast the mutex lock check to void because we dont want to use it
-    	aesd_circular_buffer_add_entry(&(dev->buff), entry);         //Add an entry to our circular buffer using the buffer
-    	mutex_unlock(&(dev->writeLock));
-    	kfree(dev->partial_write);                             //Free the kmalloc we did earlier
-    	dev->partial_write = NULL;                                  //Set partial write to NULL so nothing is carried over
-    	dev->partial_len = 0;                                       //Set partial length to 0 so nothing is carried
+    down_write(&(dev->buffLock));                                       //Only held to publish, not interruptible as the writes have already been taken from the user
+    for (i = 0; i < count; i++){
+        PDEBUG("Writing %zu bytes to buffer", batch[i].size);
+        while (aesd_circular_buffer_evict_for(&(dev->buff), batch[i].size, &removed)){  //Drop the oldest writes until this one fits
+            aesd_free_record(dev, removed.buffptr, removed.size);
+        }
+        if (dev->log_data != NULL){
+            aesd_log_append(dev, &file->partial_write[ends[i] - batch[i].size], batch[i].size);
+        }
+        else{
+            aesd_circular_buffer_add_entry(&(dev->buff), &batch[i]);    //Stored in place in the ring, nothing is left to overwrite
+        }
     }
-    else{
+    up_write(&(dev->buffLock));
+    wake_up_interruptible(&(dev->readQueue));                           //Following readers and pollers have something new
+    return 0;
+}
 
-        PDEBUG("Partial write of %s", temp_buf);
-        kfree(dev->partial_write);                              //Free the kmalloc we did earlier
-	    dev->partial_write = temp_buf;                               //Save the partial text in the struct
-	    dev->partial_len += retval;                                 //Save the length of the partial text in the struct
+/**
+ * Each segment of @param from is handled like a separate write(): appended to the file's partial command, which is
+ * complete once a segment ends with a newline.  The commands completed are added in batches of AESD_WRITE_BATCH
+ */
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct aesd_file *file = (struct aesd_file *) iocb->ki_filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    size_t count = iov_iter_count(from);
+    size_t ends[AESD_WRITE_BATCH];
+    unsigned int pending = 0;
+    int result;
+    size_t base, published = 0, command_start = 0, segment, byte_limit;
+    ssize_t retval = 0;
+
+    PDEBUG("Write %ld bytes with offset %lld",count,iocb->ki_pos);
+
+    if (count == 0){
+        return 0;
+    }
+    if (mutex_lock_interruptible(&(file->partialLock))){                //Only contended when threads share the open file
+        return -ERESTARTSYS;
+    }
+    base = file->partial_len;
+    byte_limit = READ_ONCE(dev->buff.byte_limit);
+
+    while (iov_iter_count(from)){
+        segment = iov_iter_single_seg_count(from);
+        if (segment == 0){
+            iov_iter_advance(from, 0);                                  //Steps over empty segments
+            continue;
+        }
+        if (byte_limit != 0 && file->partial_len + segment - command_start > byte_limit){   //A command that could never be kept is refused before it is buffered
+            retval = -EFBIG;
+            break;
+        }
+        retval = aesd_partial_reserve(file, file->partial_len + segment);  //Every write lands in the file's partial buffer first, outside buffLock
+        if (retval){
+            break;
+        }
+        if (copy_from_iter(&file->partial_write[file->partial_len], segment, from) != segment){
+            retval = -EFAULT;
+            break;
+        }
+        file->partial_len += segment;
+        if (file->partial_write[file->partial_len - 1] != '\n'){          //No newline yet, wait for the rest of the command
+            continue;
+        }
+        ends[pending++] = command_start = file->partial_len;
+        if (pending == AESD_WRITE_BATCH){
+            retval = aesd_publish(file, published, ends, pending);
+            if (retval){
+                pending = 0;                                            //Nothing of the batch was added
+                break;
+            }
+            published = ends[pending - 1];
+            pending = 0;
+        }
+    }
+    if (pending){                                                       //Commands completed before a fault still count
+        result = aesd_publish(file, published, ends, pending);
+        if (result == 0){
+            published = ends[pending - 1];
+        }
+        else if (retval == 0){
+            retval = result;
+        }
+    }
+
+    if (retval == 0){                                                   //Keep the unterminated rest for the next write
+        if (file->partial_write == NULL){                               //Taken over by the only command
+            file->partial_len = 0;
+        }
+        else{
+            PDEBUG("Partial write, %zu bytes buffered", file->partial_len - published);
+            memmove(file->partial_write, &file->partial_write[published], file->partial_len - published);
+            file->partial_len -= published;
+        }
+        retval = count;
+    }
+    else if (published > base){                                        //Report the bytes that made it into the device
+        file->partial_len = 0;
+        retval = published - base;
+    }
+    else{                                                               //Nothing of this write was kept
+        file->partial_len = base;
     }
 
+    mutex_unlock(&(file->partialLock));
     return retval;
 }
 
+/**
+ * Set the number of writes the device keeps, freeing the oldest ones if it shrinks
+ */
+static long aesd_set_capacity(struct aesd_dev *dev, uint32_t new_capacity){
+	struct aesd_buffer_entry *entries = NULL;
+	struct aesd_buffer_entry *old;
+	struct aesd_buffer_entry removed;
+	uint32_t slots;
+
+	if (new_capacity == 0 || new_capacity > AESDCHAR_MAX_CAPACITY){
+		return -EINVAL;
+	}
+	slots = roundup_pow_of_two(new_capacity);                        //Positions wrap with a mask instead of a division
+	if (slots > AESDCHAR_INLINE_ENTRY_SLOTS){                        //Small rings live in the slots built into the device
+		entries = kvcalloc(slots, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+		if (entries == NULL){
+			return -ENOMEM;
+		}
+	}
+
+	if (down_write_killable(&(dev->buffLock))){
+		kvfree(entries);
+		return -ERESTARTSYS;
+	}
+	while (aesd_circular_buffer_count(&(dev->buff)) > new_capacity){     //Shrinking drops the oldest writes first
+		aesd_circular_buffer_remove_oldest(&(dev->buff), &removed);
+		aesd_free_record(dev, removed.buffptr, removed.size);
+	}
+	aesd_log_update_head(dev);
+	old = aesd_circular_buffer_move(&(dev->buff), entries, slots, new_capacity);
+	up_write(&(dev->buffLock));
+
+	if (old != dev->buff.entry_inline){
+		kvfree(old);
+	}
+	PDEBUG("Capacity set to %u writes in %u slots", new_capacity, slots);
+	return 0;
+}
+
+/**
+ * Set the total bytes the device keeps, 0 for no limit, freeing the oldest writes if they no longer fit
+ */
+static long aesd_set_max_bytes(struct aesd_dev *dev, uint64_t new_max_bytes){
+	struct aesd_buffer_entry removed;
+
+	if (new_max_bytes > SIZE_MAX){
+		return -EINVAL;
+	}
+	if (dev->log_data != NULL && (new_max_bytes == 0 || new_max_bytes > dev->log_size)){   //The log can't hold more than its size
+		new_max_bytes = dev->log_size;
+	}
+	if (down_write_killable(&(dev->buffLock))){
+		return -ERESTARTSYS;
+	}
+	dev->buff.byte_limit = new_max_bytes;
+	while (aesd_circular_buffer_evict_for(&(dev->buff), 0, &removed)){   //Room for nothing more, only what is over the limit goes
+		aesd_free_record(dev, removed.buffptr, removed.size);
+	}
+	aesd_log_update_head(dev);
+	up_write(&(dev->buffLock));
+	PDEBUG("Byte limit set to %llu", new_max_bytes);
+	return 0;
+}
+
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
-	struct aesd_dev *dev = (struct aesd_dev *) filp->private_data;
+	struct aesd_file *file = (struct aesd_file *) filp->private_data;
+	struct aesd_dev *dev = file->dev;
+	struct aesd_buffer_entry *entry;
+	struct aesd_seekto seekto;
+	struct aesd_range range;
 	long retval = 0;
-	loff_t newpos = 0;
-	int curr_buffer_out_position = dev->buff.out_offs;
-	int count;
-	int idx;
-
-	if (cmd == AESDCHAR_IOCSEEKTO){
-       	(void) mutex_lock_interruptible(&(dev->writeLock));
-		struct aesd_seekto seekto;
+	uint32_t value;
+	uint64_t bytes;
+
+	switch (cmd){
+	case AESDCHAR_IOCSEEKTO:
 		if (copy_from_user(&seekto, (const void __user *) arg, sizeof(seekto)) != 0){
-			retval = -EFAULT;
+			return -EFAULT;
+		}
+		if (down_read_killable(&(dev->buffLock))){
+			return -ERESTARTSYS;
+		}
+		entry = aesd_circular_buffer_entry_at(&(dev->buff), seekto.write_cmd);
+		if (entry == NULL || entry->size < seekto.write_cmd_offset){      //No such write yet, or the offset is past its end
+			retval = -EINVAL;
 		}
 		else{
-			if (seekto.write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED){	
-				retval = -EINVAL;
-			}
-			else if (dev->buff.entry[(curr_buffer_out_position + seekto.write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].buffptr == NULL){	
-				retval = -EINVAL;
-			}
-			else if (dev->buff.entry[(curr_buffer_out_position + seekto.write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size < seekto.write_cmd_offset){
-				retval = -EINVAL;
-			}
-			else{	
-				for (count = 0; idx < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; count++){
-					if (((count + curr_buffer_out_position) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) == seekto.write_cmd){
-						newpos += seekto.write_cmd_offset;
-						break;
-					}
-					else{
-						newpos += dev->buff.entry[(curr_buffer_out_position + idx) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size;
-					}
-				}
-				filp->f_pos = newpos;
-			}
+			filp->f_pos = aesd_circular_buffer_offset_of(&(dev->buff), seekto.write_cmd) + seekto.write_cmd_offset;
 		}
-       	mutex_unlock(&(dev->writeLock));
-    }
-	return retval;
+		up_read(&(dev->buffLock));
+		return retval;
+
+	case AESDCHAR_IOCSETCAPACITY:
+		if (copy_from_user(&value, (const void __user *) arg, sizeof(value)) != 0){
+			return -EFAULT;
+		}
+		return aesd_set_capacity(dev, value);
+
+	case AESDCHAR_IOCGETCAPACITY:
+		value = READ_ONCE(dev->buff.capacity);
+		if (copy_to_user((void __user *) arg, &value, sizeof(value)) != 0){
+			return -EFAULT;
+		}
+		return 0;
+
+	case AESDCHAR_IOCTAIL:
+		if (copy_from_user(&value, (const void __user *) arg, sizeof(value)) != 0){
+			return -EFAULT;
+		}
+		if (down_read_killable(&(dev->buffLock))){
+			return -ERESTARTSYS;
+		}
+		file->tail = value != 0;
+		file->tail_fpos = filp->f_pos;                              //Follow on from the current position
+		file->tail_pos = dev->buff.end - dev->buff.total_size + filp->f_pos;
+		up_read(&(dev->buffLock));
+		return 0;
+
+	case AESDCHAR_IOCSETMAXBYTES:
+		if (copy_from_user(&bytes, (const void __user *) arg, sizeof(bytes)) != 0){
+			return -EFAULT;
+		}
+		return aesd_set_max_bytes(dev, bytes);
+
+	case AESDCHAR_IOCGETMAXBYTES:
+		bytes = READ_ONCE(dev->buff.byte_limit);
+		if (copy_to_user((void __user *) arg, &bytes, sizeof(bytes)) != 0){
+			return -EFAULT;
+		}
+		return 0;
+
+	case AESDCHAR_IOCGETRANGE:
+		if (down_read_killable(&(dev->buffLock))){
+			return -ERESTARTSYS;
+		}
+		range.start = dev->buff.end - dev->buff.total_size;
+		range.end = dev->buff.end;
+		range.epoch = dev->epoch;
+		up_read(&(dev->buffLock));
+		if (copy_to_user((void __user *) arg, &range, sizeof(range)) != 0){
+			return -EFAULT;
+		}
+		return 0;
+	}
+	return -ENOTTY;
+}
+
+__poll_t aesd_poll(struct file *filp, poll_table *wait){
+	struct aesd_file *file = (struct aesd_file *) filp->private_data;
+	struct aesd_dev *dev = file->dev;
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;                         //Writes never wait for room, the oldest are dropped
+	size_t end, total, oldest;
+	loff_t pos = filp->f_pos;
+
+	poll_wait(filp, &(dev->readQueue), wait);
+	end = READ_ONCE(dev->buff.end);
+	total = READ_ONCE(dev->buff.total_size);
+	oldest = end - total;
+	if (file->tail && pos == file->tail_fpos){                      //Where the next read will continue, as aesd_tail_wait works it out
+		pos = (file->tail_pos - oldest > total) ? 0 : file->tail_pos - oldest;
+	}
+	if (pos < total || !file->tail){                                //Without tail, a read at the end returns 0 straight away
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	return mask;
+}
+
+/**
+ * Map the log read only: the header page, then the data pages twice back to back, so any range of up to
+ * data_size bytes can be read in one piece
+ */
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma){
+	struct aesd_dev *dev = ((struct aesd_file *) filp->private_data)->dev;
+	unsigned long data_pages = dev->log_size >> PAGE_SHIFT;
+	unsigned long addr, page;
+	int result;
+
+	if (dev->log_data == NULL){                                     //Only writes kept in the log can be mapped
+		return -ENODEV;
+	}
+	if (vma->vm_flags & VM_WRITE){
+		return -EACCES;
+	}
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > (1 + 2 * data_pages) << PAGE_SHIFT){
+		return -EINVAL;
+	}
+	vm_flags_clear(vma, VM_MAYWRITE);                               //Can't be made writable with mprotect later
+	for (addr = vma->vm_start, page = 0; addr < vma->vm_end; addr += PAGE_SIZE, page++){
+		result = vm_insert_page(vma, addr, page == 0 ? dev->log_pages[0] : dev->log_pages[1 + (page - 1) % data_pages]);
+		if (result){
+			return result;
+		}
+	}
+	return 0;
 }
 
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence){
 
-	struct aesd_buffer_entry *entry;
-    	uint8_t index;
-	loff_t size = 0;
+	struct aesd_dev *dev = ((struct aesd_file *) filp->private_data)->dev;
+	loff_t size;
 
-	AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buff, index) {
-	    	if (entry->buffptr){
-	    		size += entry->size;
-	    	}
+	if (down_read_killable(&(dev->buffLock))){
+		return -ERESTARTSYS;
 	}
+	size = dev->buff.total_size;                                    //Kept up to date as writes are added and dropped
+	up_read(&(dev->buffLock));
 	return fixed_size_llseek(filp, offset, whence, size);
 }
 
 struct file_operations aesd_fops = {                       //File operations as given
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .read_iter = aesd_read_iter,
+    .splice_read = copy_splice_read,                        //splice and sendfile from the device, through aesd_read_iter
+    .write_iter = aesd_write_iter,
     .open =     aesd_open,
     .release =  aesd_release,
     .llseek = aesd_llseek,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap = aesd_mmap,
+    .poll = aesd_poll,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+/**
+ * Free the log and its pages, if @param dev has one
+ */
+static void aesd_log_free(struct aesd_dev *dev)
+{
+    unsigned long page;
+
+    if (dev->log_data != NULL){
+        vunmap(dev->log_data);
+        dev->log_data = NULL;
+    }
+    if (dev->log_pages != NULL){
+        for (page = 0; page <= dev->log_size >> PAGE_SHIFT; page++){
+            if (dev->log_pages[page] != NULL){
+                __free_page(dev->log_pages[page]);
+            }
+        }
+        kvfree(dev->log_pages);
+        dev->log_pages = NULL;
+    }
+}
+
+/**
+ * Allocate a log of @param size bytes for @param dev, a power of two pages, with its header page, and keep the
+ * writes in it as the ring of dev->buff.  The buffer must still be empty
+ */
+static int aesd_log_init(struct aesd_dev *dev, size_t size)
+{
+    unsigned long data_pages = size >> PAGE_SHIFT;
+    unsigned long page;
+
+    dev->log_pages = kvcalloc(data_pages + 1, sizeof(struct page *), GFP_KERNEL);
+    if (dev->log_pages == NULL){
+        goto fail;
+    }
+    for (page = 0; page <= data_pages; page++){
+        dev->log_pages[page] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (dev->log_pages[page] == NULL){
+            goto fail;
+        }
+    }
+    dev->log_data = vmap(&(dev->log_pages[1]), data_pages, VM_MAP, PAGE_KERNEL);
+    if (dev->log_data == NULL){
+        goto fail;
+    }
+
+    dev->log_size = size;
+    dev->log_header = page_address(dev->log_pages[0]);
+    dev->log_header->data_offset = PAGE_SIZE;
+    dev->log_header->data_size = size;
+    dev->log_header->tail = dev->buff.end;
+    dev->log_header->head = dev->buff.end;
+    aesd_circular_buffer_use_ring(&(dev->buff), dev->log_data, size);
+    return 0;
+
+fail:
+    dev->log_size = size;
+    aesd_log_free(dev);
+    return -ENOMEM;
+}
+
+
+static int aesd_setup_cdev(struct aesd_dev *dev, int minor)
 {
-    int error, deviceno = MKDEV(aesd_major, aesd_minor);
+    int error, deviceno = MKDEV(aesd_major, minor);
 
     cdev_init(&dev->chardev, &aesd_fops);                   //Initialize the character device
     dev->chardev.owner = THIS_MODULE;                       //Declare this module as the owner
     dev->chardev.ops = &aesd_fops;                          //Declare our file operations
     error = cdev_add(&dev->chardev, deviceno, 1);           //Ask the kernel for a character device
     if (error) {                                            //If an error is indicated print and return
-        printk(KERN_ERR "Error %d adding aesd cdev", error);
+        printk(KERN_ERR "Error %d adding aesd cdev %d", error, minor);
     }
     return error;
 }
 
+/**
+ * Free the writes kept by @param dev and its storage, once its cdev is gone or was never added
+ */
+static void aesd_dev_free(struct aesd_dev *dev)
+{
+    struct aesd_buffer_entry *entry;
+    uint32_t index;
 
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buff, index) {
+    	aesd_free_record(dev, entry->buffptr, entry->size);     //Empty slots have a NULL buffptr
+    }
+    if (dev->buff.entry != dev->buff.entry_inline){
+    	kvfree(dev->buff.entry);    //Entry slots allocated for a capacity above the built in ones
+    }
+    aesd_log_free(dev);
+}
+
+/**
+ * Set up @param dev with the history size given at load time and add it as @param minor.  The parameters are
+ * already checked, so only running out of memory or cdev_add can fail, leaving nothing to free
+ */
+static int aesd_dev_init(struct aesd_dev *dev, int minor)
+{
+    int result = 0;
+
+    aesd_circular_buffer_init(&dev->buff);  //Declare the circular buffer we wrote last time
+    init_rwsem(&(dev->buffLock));           //Declare the lock guarding the circular buffer
+    init_waitqueue_head(&(dev->readQueue));
+    dev->epoch = get_random_u64() | 1;      //Never 0, so a client that never saw the device can't match it
+
+    if (capacity != AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED){  //Ask for the history size given at load time
+        result = aesd_set_capacity(dev, capacity);
+    }
+    dev->buff.byte_limit = max_bytes;       //Nothing is stored yet, so there is nothing to evict
+    if (result == 0 && log_size != 0) {
+        result = aesd_log_init(dev, roundup_pow_of_two(max_t(ulong, log_size, PAGE_SIZE)));
+        if (result == 0 && (max_bytes == 0 || max_bytes > dev->log_size)) {   //The log can't hold more than its size
+            dev->buff.byte_limit = dev->log_size;
+        }
+    }
+    if (result == 0) {
+        result = aesd_setup_cdev(dev, minor);
+    }
+    if (result) {
+        aesd_dev_free(dev);
+    }
+    return result;
+}
 
 int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1, "aesdchar");  //Allocate the device region
+    uint i;
+
+    if (devices == 0 || devices > AESD_MAX_DEVICES) {
+        printk(KERN_ERR "Invalid devices %u, must be 1 to %u\n", devices, AESD_MAX_DEVICES);
+        return -EINVAL;
+    }
+    if (capacity == 0 || capacity > AESDCHAR_MAX_CAPACITY) {
+        printk(KERN_ERR "Invalid capacity %u, must be 1 to %u\n", capacity, AESDCHAR_MAX_CAPACITY);
+        return -EINVAL;
+    }
+    if (log_size > AESD_MAX_LOG_SIZE) {
+        printk(KERN_ERR "Invalid log_size %lu, must be at most %lu\n", log_size, AESD_MAX_LOG_SIZE);
+        return -EINVAL;
+    }
+
+    result = alloc_chrdev_region(&dev, aesd_minor, devices, "aesdchar");  //Allocate the device region
     aesd_major = MAJOR(dev);                                        //Ask for the device major and return as result
     if (result < 0) {                                               //Check if we have a major and error if not
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device, 0, sizeof(struct aesd_dev));   //Set the memory region to 0 so code wont be reused
-    
-    aesd_circular_buffer_init(&aesd_device.buff);  //Declare the circular buffer we wrote last time
-    aesd_device.partial_write = NULL;       //Set the region to null so we dont potentially reuse old code
-    aesd_device.partial_len = 0;            //Set the length to zero
-    mutex_init(&(aesd_device.writeLock));   //Declare the mutex region to lock
 
-    result = aesd_setup_cdev(&aesd_device);
+    aesd_record_cache = kmem_cache_create("aesdchar_record", AESD_SMALL_RECORD, 0, SLAB_HWCACHE_ALIGN, NULL);
+    aesd_devices = kcalloc(devices, sizeof(struct aesd_dev), GFP_KERNEL);   //Zeroed so nothing is reused
+    if (aesd_record_cache == NULL || aesd_devices == NULL) {
+        result = -ENOMEM;
+        goto fail_alloc;
+    }
 
-    if(result) {                            //If result indicates an error unregister the device region
-        unregister_chrdev_region(dev, 1);
+    for (i = 0; i < devices; i++) {
+        result = aesd_dev_init(&aesd_devices[i], aesd_minor + i);
+        if (result) {
+            goto fail_devices;
+        }
     }
-    return result;
+    return 0;
 
+fail_devices:
+    while (i--) {                           //Undo the devices added before the one that failed
+        cdev_del(&aesd_devices[i].chardev);
+        aesd_dev_free(&aesd_devices[i]);
+    }
+fail_alloc:
+    kfree(aesd_devices);
+    if (aesd_record_cache != NULL) kmem_cache_destroy(aesd_record_cache);
+    unregister_chrdev_region(dev, devices);
+    return result;
 }
 
 void aesd_cleanup_module(void)
 {
     dev_t deviceno = MKDEV(aesd_major, aesd_minor);
-    struct aesd_buffer_entry *entry;
-    uint8_t index;
-
-    cdev_del(&aesd_device.chardev);                //Delete the character device
+    uint i;
 
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buff, index) {
-    	if (entry->buffptr)                       //Check if there is a buffer allocated
-    	{
-    		kfree(entry->buffptr);         //Free the buffer we previously defined so it can be reused elsewhere
-    	}
+    for (i = 0; i < devices; i++) {
+        cdev_del(&aesd_devices[i].chardev);        //Delete the character device
+        aesd_dev_free(&aesd_devices[i]);
     }
+    kfree(aesd_devices);
+    kmem_cache_destroy(aesd_record_cache);      //Every record from the cache has been freed above
 
-    unregister_chrdev_region(deviceno, 1);      //Deregister the device region
+    unregister_chrdev_region(deviceno, devices);      //Deregister the device region
 }
 
 
@@ -0,0 +1,439 @@
+/*
+ * aesdsocket-bench.c
+ *
+ *  Load generator for aesdsocket. Keeps up to a fixed number of clients in
+ *  flight against the server, each sending one packet and reading the replay
+ *  until the server closes. Every replay is checked to contain the client's
+ *  own packet as a whole line and no NUL bytes. Reports throughput, the peak
+ *  RSS and thread count of the server process and a latency histogram.
+ *
+ *  Latency runs from when a connection was due to start to when the server
+ *  closed it. With a rate set, a client held back by the concurrency limit
+ *  still counts from its scheduled start, so a stalled server shows up in the
+ *  tail instead of just slowing the generator down.
+ *
+ *  Usage: aesdsocket-bench [-a address] [-c concurrent] [-n connections] [-t seconds]
+ *                          [-p size | -p min-max] [-r connections/sec] [-s server pid] [-j]
+ *
+ *  -j prints a JSON report with the full HDR histogram instead of the text summary.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PORT 9000
+#define BUFFER 65536
+#define EPOLL_EVENTS 256
+#define SAMPLE_MS 100   //How often the server process is sampled
+
+//HDR histogram of microseconds with 3 significant digits: 2048 linear sub-buckets, doubling in width per bucket
+#define HDR_SUB_BITS 11
+#define HDR_SUB_COUNT (1 << HDR_SUB_BITS)
+#define HDR_HALF_COUNT (HDR_SUB_COUNT / 2)
+#define HDR_BUCKETS 26      //Tracks values up to about 19 hours
+#define HDR_COUNTS ((HDR_BUCKETS + 1) * HDR_HALF_COUNT)
+
+enum client_state {
+    CLIENT_CONNECTING,
+    CLIENT_SENDING,
+    CLIENT_RECEIVING,
+};
+
+struct client {
+    int fd;
+    enum client_state state;
+    char *packet;       //Packet sent on this connection, newline included
+    size_t packet_len;
+    size_t sent;
+    size_t received;    //Replay bytes received on this connection
+    size_t line_pos;    //Bytes of the current replay line matching the packet so far
+    bool line_match;    //Current replay line still matches the packet
+    bool found;         //Packet seen as a whole line of the replay
+    bool corrupt;       //Replay held a NUL byte
+    double due;         //When this connection was scheduled to start
+};
+
+struct server_sample {
+    long rss_kb;        //Peak resident set size seen while sampling
+    long threads;       //Peak thread count seen while sampling
+};
+
+static struct sockaddr_in address;
+static char recvbuf[BUFFER];
+static long started = 0, completed = 0, failed = 0, mismatched = 0;
+static unsigned long long bytes_sent = 0, bytes_received = 0;
+static size_t packet_min = 0, packet_max = 0;   //0 keeps the short default packet
+
+static uint64_t hdr_counts[HDR_COUNTS];
+static uint64_t hdr_total = 0, hdr_min = UINT64_MAX, hdr_max = 0;
+static double hdr_sum = 0;
+
+static double nowSeconds(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int hdrIndex(uint64_t value){
+    int msb = 63 - __builtin_clzll(value | (HDR_SUB_COUNT - 1));
+    int bucket = msb - (HDR_SUB_BITS - 1);
+    int sub = (int)(value >> bucket);
+    int index = ((bucket + 1) << (HDR_SUB_BITS - 1)) + sub - HDR_HALF_COUNT;
+    return index < HDR_COUNTS ? index : HDR_COUNTS - 1;
+}
+
+//Highest value that lands in the same slot as index
+static uint64_t hdrValue(int index){
+    int bucket = (index >> (HDR_SUB_BITS - 1)) - 1;
+    uint64_t sub = (index & (HDR_HALF_COUNT - 1)) + HDR_HALF_COUNT;
+    if (bucket < 0) {
+        bucket = 0;
+        sub = index;
+    }
+    return ((sub + 1) << bucket) - 1;
+}
+
+static void hdrRecord(uint64_t value){
+    hdr_counts[hdrIndex(value)]++;
+    hdr_total++;
+    hdr_sum += value;
+    if (value < hdr_min) hdr_min = value;
+    if (value > hdr_max) hdr_max = value;
+}
+
+static uint64_t hdrPercentile(double percentile){
+    if (hdr_total == 0) return 0;
+    uint64_t rank = (uint64_t)(percentile / 100.0 * hdr_total + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HDR_COUNTS; i++) {
+        seen += hdr_counts[i];
+        if (seen >= rank) return hdrValue(i) < hdr_max ? hdrValue(i) : hdr_max;
+    }
+    return hdr_max;
+}
+
+static void serverSample(pid_t pid, struct server_sample *sample){
+    char path[64], line[256];
+    long value;
+
+    if (pid <= 0) return;
+    snprintf(path, sizeof path, "/proc/%d/status", (int)pid);
+    FILE *status = fopen(path, "r");
+    if (status == NULL) return;
+    while (fgets(line, sizeof line, status) != NULL) {
+        if (sscanf(line, "VmRSS: %ld", &value) == 1 && value > sample->rss_kb) sample->rss_kb = value;
+        if (sscanf(line, "Threads: %ld", &value) == 1 && value > sample->threads) sample->threads = value;
+    }
+    fclose(status);
+}
+
+//Fill the client's packet, unique per connection, padded to a size between packet_min and packet_max
+static void packetFill(struct client *c){
+    char header[64];
+    int header_len = snprintf(header, sizeof header, "aesdsocket-bench %ld", started);
+    size_t len = header_len + 1;
+
+    if (packet_max > 0) {
+        len = packet_min + (packet_max > packet_min ? (size_t) rand() % (packet_max - packet_min + 1) : 0);
+        if (len < (size_t) header_len + 1) len = header_len + 1;
+    }
+    memcpy(c->packet, header, header_len);
+    for (size_t i = header_len; i < len - 1; i++) c->packet[i] = 'a' + i % 26;
+    c->packet[len - 1] = '\n';
+    c->packet_len = len;
+}
+
+static bool clientStart(int epoll_fd, struct client *c, double due){
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd == -1) {
+        perror("socket");
+        return false;
+    }
+    c->state = CLIENT_CONNECTING;
+    c->sent = 0;
+    c->received = 0;
+    c->line_pos = 0;
+    c->line_match = true;
+    c->found = false;
+    c->corrupt = false;
+    c->due = due;
+    started++;
+    packetFill(c);
+    if (connect(c->fd, (struct sockaddr *)&address, sizeof address) == -1 && errno != EINPROGRESS) {
+        close(c->fd);
+        failed++;
+        return false;
+    }
+    struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        close(c->fd);
+        failed++;
+        return false;
+    }
+    return true;
+}
+
+//Match the replay line by line against the packet, without keeping more than the current chunk
+static void replayCheck(struct client *c, const char *buf, size_t len){
+    if (memchr(buf, '\0', len) != NULL) c->corrupt = true;
+    while (len > 0) {
+        const char *newline = memchr(buf, '\n', len);
+        size_t segment = (newline != NULL) ? (size_t)(newline - buf) + 1 : len;
+
+        if (c->line_match) {
+            if (c->line_pos + segment <= c->packet_len && memcmp(buf, c->packet + c->line_pos, segment) == 0) {
+                c->line_pos += segment;
+            }
+            else {
+                c->line_match = false;
+            }
+        }
+        if (newline != NULL) {
+            if (c->line_match && c->line_pos == c->packet_len) c->found = true;
+            c->line_pos = 0;
+            c->line_match = true;
+        }
+        buf += segment;
+        len -= segment;
+    }
+}
+
+//Returns true once the client has finished, successfully or not
+static bool clientHandle(int epoll_fd, struct client *c){
+    if (c->state == CLIENT_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof error;
+
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            close(c->fd);
+            failed++;
+            return true;
+        }
+        c->state = CLIENT_SENDING;
+    }
+
+    if (c->state == CLIENT_SENDING) {
+        while (c->sent < c->packet_len) {
+            ssize_t bytes_sent_now = send(c->fd, c->packet + c->sent, c->packet_len - c->sent, MSG_NOSIGNAL);
+            if (bytes_sent_now == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+            if (bytes_sent_now < 1) {
+                close(c->fd);
+                failed++;
+                return true;
+            }
+            c->sent += bytes_sent_now;
+            bytes_sent += bytes_sent_now;
+        }
+        c->state = CLIENT_RECEIVING;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+
+    while (1) {
+        ssize_t bytes_read = recv(c->fd, recvbuf, sizeof recvbuf, 0);
+        if (bytes_read > 0) {
+            bytes_received += bytes_read;
+            c->received += bytes_read;
+            replayCheck(c, recvbuf, bytes_read);
+            continue;
+        }
+        if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+        if (bytes_read == 0 && c->received > 0) {     //Server closes once the replay is sent, a shed client gets nothing
+            if (c->found && !c->corrupt) {
+                completed++;
+                hdrRecord((uint64_t)((nowSeconds() - c->due) * 1e6));
+            }
+            else {
+                mismatched++;
+            }
+        }
+        else {
+            failed++;
+        }
+        close(c->fd);
+        return true;
+    }
+}
+
+static void reportJson(long concurrent, double rate, double elapsed, pid_t server_pid, const struct server_sample *sample){
+    printf("{\n");
+    printf("  \"concurrent\": %ld,\n", concurrent);
+    printf("  \"rate\": %.1f,\n", rate);
+    printf("  \"packet_min\": %zu,\n  \"packet_max\": %zu,\n", packet_min, packet_max);
+    printf("  \"completed\": %ld,\n  \"failed\": %ld,\n  \"mismatched\": %ld,\n", completed, failed, mismatched);
+    printf("  \"elapsed_s\": %.3f,\n", elapsed);
+    printf("  \"connections_per_sec\": %.1f,\n", completed / elapsed);
+    printf("  \"bytes_sent\": %llu,\n  \"bytes_replayed\": %llu,\n", bytes_sent, bytes_received);
+    printf("  \"replay_mb_per_sec\": %.2f,\n", bytes_received / elapsed / 1e6);
+    if (server_pid > 0) {
+        printf("  \"server_peak_rss_kb\": %ld,\n  \"server_peak_threads\": %ld,\n", sample->rss_kb, sample->threads);
+    }
+    printf("  \"latency_us\": {\n");
+    printf("    \"count\": %llu,\n", (unsigned long long) hdr_total);
+    printf("    \"min\": %llu,\n", (unsigned long long)(hdr_total ? hdr_min : 0));
+    printf("    \"mean\": %.1f,\n", hdr_total ? hdr_sum / hdr_total : 0.0);
+    printf("    \"p50\": %llu,\n", (unsigned long long) hdrPercentile(50));
+    printf("    \"p90\": %llu,\n", (unsigned long long) hdrPercentile(90));
+    printf("    \"p99\": %llu,\n", (unsigned long long) hdrPercentile(99));
+    printf("    \"p999\": %llu,\n", (unsigned long long) hdrPercentile(99.9));
+    printf("    \"max\": %llu,\n", (unsigned long long) hdr_max);
+    printf("    \"significant_digits\": 3,\n");
+    printf("    \"histogram\": [");     //Non-empty slots as [highest equivalent value, count]
+    bool first = true;
+    for (int i = 0; i < HDR_COUNTS; i++) {
+        if (hdr_counts[i] == 0) continue;
+        printf("%s[%llu, %llu]", first ? "" : ", ", (unsigned long long) hdrValue(i), (unsigned long long) hdr_counts[i]);
+        first = false;
+    }
+    printf("]\n  }\n}\n");
+}
+
+static bool packetSizes(const char *arg){
+    char *end;
+    packet_min = strtoul(arg, &end, 10);
+    packet_max = (*end == '-') ? strtoul(end + 1, &end, 10) : packet_min;
+    return *end == '\0' && packet_min > 0 && packet_max >= packet_min;
+}
+
+int main(int argc, char *argv[]){
+    const char *host = "127.0.0.1";
+    long concurrent = 1000, connections = 0;
+    double duration = 0, rate = 0;
+    bool json = false;
+    pid_t server_pid = 0;
+    struct server_sample sample = { 0 };
+    struct epoll_event events[EPOLL_EVENTS];
+    struct rlimit limit;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:c:n:t:p:r:s:j")) != -1) {
+        switch (opt) {
+        case 'a': host = optarg; break;
+        case 'c': concurrent = atol(optarg); break;
+        case 'n': connections = atol(optarg); break;
+        case 't': duration = atof(optarg); break;
+        case 'p':
+            if (packetSizes(optarg)) break;
+            fprintf(stderr, "Invalid packet size %s\n", optarg);
+            return 1;
+        case 'r': rate = atof(optarg); break;
+        case 's': server_pid = atoi(optarg); break;
+        case 'j': json = true; break;
+        default:
+            fprintf(stderr, "Usage: %s [-a address] [-c concurrent] [-n connections] [-t seconds] "
+                            "[-p size | -p min-max] [-r connections/sec] [-s server pid] [-j]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (concurrent < 1) concurrent = 1;
+    if (duration > 0 && connections == 0) connections = -1;     //Run for the duration only
+    else if (connections < concurrent) connections = concurrent;
+
+    memset(&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_port = htons(PORT);
+    if (inet_pton(AF_INET, host, &address.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address %s\n", host);
+        return 1;
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    struct client *clients = (struct client *)calloc(concurrent, sizeof *clients);
+    struct client **idle = (struct client **)calloc(concurrent, sizeof *idle);
+    int epoll_fd = epoll_create1(0);
+    if (clients == NULL || idle == NULL || epoll_fd == -1) {
+        perror("setup");
+        return 1;
+    }
+    size_t packet_size = packet_max > 64 ? packet_max : 64;
+    for (long i = 0; i < concurrent; i++) {
+        clients[i].packet = malloc(packet_size);
+        if (clients[i].packet == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        idle[i] = &clients[i];
+    }
+    srand(getpid());
+
+    double start = nowSeconds(), next_sample = start;
+    long active = 0, idle_count = concurrent;
+    while (1) {
+        double now = nowSeconds();
+        bool more = (connections < 0 || started < connections) && (duration <= 0 || now - start < duration);
+
+        //Start whatever is due: everything the concurrency limit allows, or the rate's schedule so far
+        while (more && idle_count > 0) {
+            double due = (rate > 0) ? start + started / rate : now;
+            if (due > now) break;
+            if (clientStart(epoll_fd, idle[idle_count - 1], due)) {
+                idle_count--;
+                active++;
+            }
+            more = connections < 0 || started < connections;
+        }
+        if (active == 0 && !more) break;
+
+        int timeout = SAMPLE_MS;
+        if (more && rate > 0 && idle_count > 0) {
+            int until_due = (int)((start + started / rate - now) * 1000);
+            if (until_due < timeout) timeout = until_due > 0 ? until_due : 0;
+        }
+        int count = epoll_wait(epoll_fd, events, EPOLL_EVENTS, timeout);
+        for (int i = 0; i < count; i++) {
+            struct client *c = (struct client *)events[i].data.ptr;
+            if (!clientHandle(epoll_fd, c)) continue;
+            active--;
+            idle[idle_count++] = c;
+        }
+        if (nowSeconds() >= next_sample) {
+            serverSample(server_pid, &sample);
+            next_sample += SAMPLE_MS / 1000.0;
+        }
+    }
+    double elapsed = nowSeconds() - start;
+    serverSample(server_pid, &sample);
+
+    if (json) {
+        reportJson(concurrent, rate, elapsed, server_pid, &sample);
+    }
+    else {
+        printf("concurrent:      %ld\n", concurrent);
+        printf("connections:     %ld completed, %ld failed, %ld mismatched\n", completed, failed, mismatched);
+        printf("elapsed:         %.3f s\n", elapsed);
+        printf("connections/sec: %.1f\n", completed / elapsed);
+        printf("bytes replayed:  %llu\n", bytes_received);
+        printf("latency us:      p50 %llu, p99 %llu, p999 %llu, max %llu\n", (unsigned long long) hdrPercentile(50),
+               (unsigned long long) hdrPercentile(99), (unsigned long long) hdrPercentile(99.9), (unsigned long long) hdr_max);
+        if (server_pid > 0) {
+            printf("server peak RSS: %ld KiB\n", sample.rss_kb);
+            printf("server threads:  %ld peak\n", sample.threads);
+        }
+    }
+
+    for (long i = 0; i < concurrent; i++) free(clients[i].packet);
+    free(idle);
+    free(clients);
+    close(epoll_fd);
+    return (failed == 0 && mismatched == 0) ? 0 : 1;
+}
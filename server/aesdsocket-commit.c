@@ -0,0 +1,164 @@
+/*
+ * aesdsocket-commit.c
+ *
+ *  Group commit for aesdsocket appends. Clients queue their completed packet
+ *  and sleep, a single writer thread takes what is queued, waiting at most
+ *  GROUP_COMMIT_LATENCY_US for up to GROUP_COMMIT_BATCH packets to gather,
+ *  flushes them with one vectored write and wakes the whole batch at once.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslog.h>
+#include <sys/uio.h>
+#include <time.h>
+#include "aesdsocket.h"
+
+#if GROUP_COMMIT_BATCH < 1 || GROUP_COMMIT_BATCH > 1024
+#error "GROUP_COMMIT_BATCH must be between 1 and IOV_MAX"
+#endif
+
+#define HISTOGRAM_BUCKETS 16    //Power of two buckets, the last one also counts everything larger
+
+struct commit_request {     //Lives on the waiting client's stack until its batch is flushed
+    const char *buf;
+    size_t len;
+    uint64_t seq;
+    struct timespec queued;
+    struct commit_request *next;
+};
+
+static pthread_mutex_t commitMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commitQueued;    //Wakes the writer, monotonic clock for the latency deadline
+static pthread_cond_t commitFlushed = PTHREAD_COND_INITIALIZER;
+static pthread_once_t commitOnce = PTHREAD_ONCE_INIT;
+
+static struct commit_request *queue_head = NULL, *queue_tail = NULL;
+static size_t queue_len = 0;
+static uint64_t queued_seq = 0, flushed_seq = 0;
+static off_t flushed_end = 0;     //End of the data file after the last flush
+
+static unsigned long batch_histogram[HISTOGRAM_BUCKETS];    //Packets per flush
+static unsigned long latency_histogram[HISTOGRAM_BUCKETS];  //Microseconds from the oldest packet queued to its flush finishing
+static unsigned long flushes = 0, packets = 0;
+
+static int histogramBucket(uint64_t value){
+    int bucket = 0;
+    while (value > 1 && bucket < HISTOGRAM_BUCKETS - 1) {
+        value >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static uint64_t elapsedMicros(const struct timespec *from, const struct timespec *to){
+    return (to->tv_sec - from->tv_sec) * 1000000ULL + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static void *writerRoutine(void *arg){
+    struct iovec iov[GROUP_COMMIT_BATCH];
+    (void)arg;
+
+    pthread_mutex_lock(&commitMutex);
+    while (1) {
+        while (queue_head == NULL) pthread_cond_wait(&commitQueued, &commitMutex);
+
+        //Give other clients until the oldest packet's deadline to join the batch
+        struct timespec deadline = queue_head->queued;
+        deadline.tv_nsec += (GROUP_COMMIT_LATENCY_US % 1000000) * 1000L;
+        deadline.tv_sec += GROUP_COMMIT_LATENCY_US / 1000000 + deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (queue_len < GROUP_COMMIT_BATCH) {
+            if (pthread_cond_timedwait(&commitQueued, &commitMutex, &deadline) == ETIMEDOUT) break;
+        }
+
+        struct timespec oldest = queue_head->queued;
+        uint64_t last_seq = 0;
+        int count = 0;
+        while (queue_head != NULL && count < GROUP_COMMIT_BATCH) {
+            iov[count].iov_base = (void *)queue_head->buf;
+            iov[count].iov_len = queue_head->len;
+            last_seq = queue_head->seq;
+            queue_head = queue_head->next;
+            count++;
+        }
+        if (queue_head == NULL) queue_tail = NULL;
+        queue_len -= count;
+        pthread_mutex_unlock(&commitMutex);
+
+        off_t end = fileAppendv(iov, count);    //One write for the whole batch
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock(&commitMutex);
+        flushed_seq = last_seq;
+        flushed_end = end;
+        flushes++;
+        packets += count;
+        batch_histogram[histogramBucket(count)]++;
+        latency_histogram[histogramBucket(elapsedMicros(&oldest, &now))]++;
+        pthread_cond_broadcast(&commitFlushed);
+    }
+    return NULL;
+}
+
+static void groupCommitStart(){
+    pthread_condattr_t attr;
+    pthread_t pthread;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&commitQueued, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&pthread, NULL, writerRoutine, NULL) != 0) {
+        syslog(LOG_ERR, "ERROR with group commit pthread_create");
+        exit(1);
+    }
+    pthread_detach(pthread);
+}
+
+off_t groupCommit(const char *buf, size_t len){
+    struct commit_request request = { .buf = buf, .len = len, .next = NULL };
+
+    pthread_once(&commitOnce, groupCommitStart);
+    clock_gettime(CLOCK_MONOTONIC, &request.queued);
+
+    metricLock(&commitMutex, METRIC_COMMIT_WAIT_NS);
+    request.seq = ++queued_seq;
+    if (queue_tail != NULL) queue_tail->next = &request;
+    else queue_head = &request;
+    queue_tail = &request;
+    queue_len++;
+    if (queue_len == 1 || queue_len >= GROUP_COMMIT_BATCH) {
+        pthread_cond_signal(&commitQueued);     //Wake the writer to start a batch, or to stop waiting for a full one
+    }
+
+    while (flushed_seq < request.seq) pthread_cond_wait(&commitFlushed, &commitMutex);
+    off_t end = flushed_end;    //At or past the end of this packet, a later batch may already have been flushed
+    pthread_mutex_unlock(&commitMutex);
+    return end;
+}
+
+static int histogramFormat(char *buf, size_t size, const char *name, const unsigned long *histogram){
+    int len = snprintf(buf, size, "%s", name);
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (histogram[i] == 0 || len < 0 || (size_t) len >= size) continue;
+        len += snprintf(buf + len, size - len, " %s%lu:%lu", (i == HISTOGRAM_BUCKETS - 1) ? ">=" : "<",
+                        (i == HISTOGRAM_BUCKETS - 1) ? (1UL << i) : (2UL << i), histogram[i]);
+    }
+    return len;
+}
+
+void groupCommitStats(char *buf, size_t size){
+    pthread_mutex_lock(&commitMutex);   //The writer only holds it between flushes, so this never waits on a write
+    int len = snprintf(buf, size, "group commit %lu flushes of %lu packets;", flushes, packets);
+    if (len >= 0 && (size_t) len < size) len += histogramFormat(buf + len, size - len, " batch size", batch_histogram);
+    if (len >= 0 && (size_t) len < size) len += snprintf(buf + len, size - len, ";");
+    if (len >= 0 && (size_t) len < size) histogramFormat(buf + len, size - len, " flush latency us", latency_histogram);
+    pthread_mutex_unlock(&commitMutex);
+}
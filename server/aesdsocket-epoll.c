@@ -0,0 +1,227 @@
+/*
+ * aesdsocket-epoll.c
+ *
+ *  Event driven client handling for aesdsocket. One or more reactor threads
+ *  multiplex non-blocking client sockets with epoll, each connection walking
+ *  through the receive, append and replay states instead of owning a thread.
+ */
+
+#define _GNU_SOURCE    //accept4
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syslog.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "aesdsocket.h"
+
+enum conn_state {
+    CONN_RECV,      //Receiving until a newline terminated packet is complete
+    CONN_APPEND,    //Packet complete, append it to the file
+    CONN_REPLAY,    //Sending the file contents back to the client
+};
+
+struct conn {
+    int fd;
+    enum conn_state state;
+    recv_buffer_t rb;   //Receive buffer, reused as the replay buffer once the packet is appended
+    size_t len;         //Replay bytes held in rb.buf
+    size_t sent;        //Bytes of rb.buf already sent during replay
+    off_t replay_off;   //Next file offset to replay
+    off_t replay_end;   //File length snapshot taken at append time, -1 to replay the char device until end of file
+    uint64_t replay_started;    //From metricNow
+    char client_ip[INET_ADDRSTRLEN];
+};
+
+static void connClose(struct conn *c){
+    close(c->fd);   //Closing the descriptor also removes it from the epoll set
+    metricAdd(METRIC_CLOSED, 1);
+    syslog(LOG_DEBUG, "Closed connection from %s", c->client_ip);
+    free(c->rb.buf);
+    free(c);
+}
+
+static void connAccept(int epoll_fd, int listen_fd){
+    while (1) {
+        struct sockaddr_in client_address;
+        socklen_t client_address_len = sizeof client_address;
+        int fd = accept4(listen_fd, (struct sockaddr *)&client_address, &client_address_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) syslog(LOG_ERR, "ERROR with accept: %s", strerror(errno));
+            return;     //Either drained the backlog or out of descriptors, wait for the next event
+        }
+
+        struct conn *c = (struct conn *)calloc(1, sizeof *c);
+        if (c == NULL) {
+            syslog(LOG_ERR, "ERROR with connection malloc");
+            close(fd);
+            continue;
+        }
+        metricAdd(METRIC_ACCEPTED, 1);
+        c->fd = fd;
+        c->state = CONN_RECV;
+        inet_ntop(AF_INET, &(client_address.sin_addr), c->client_ip, INET_ADDRSTRLEN);
+        syslog(LOG_DEBUG, "Accepted connection from %s", c->client_ip);
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = c };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            syslog(LOG_ERR, "ERROR with epoll_ctl: %s", strerror(errno));
+            connClose(c);
+        }
+    }
+}
+
+//Returns false once the connection has been closed and freed
+static bool connRecv(struct conn *c){
+    ssize_t packet_len = packetReceive(c->fd, &c->rb);
+    if (packet_len < 0) {
+        connClose(c);
+        return false;
+    }
+    if (packet_len > 0) {
+        c->len = packet_len;    //Anything after the newline is not part of this packet
+        c->state = CONN_APPEND;
+    }
+    return true;
+}
+
+//Returns false once the connection has been closed and freed
+static bool connReplay(struct conn *c){
+    while (1) {
+        if (USE_AESD_CHAR_DEVICE == 0 && c->sent == c->len) {   //Regular file, send straight from the page cache
+            if (c->replay_off >= c->replay_end) break;
+            ssize_t bytes_send = fileSendfile(c->fd, &c->replay_off, c->replay_end);
+            if (bytes_send == -1) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return true;   //Socket buffer full, wait for EPOLLOUT
+                syslog(LOG_ERR, "ERROR with sendfile: %s", strerror(errno));
+            }
+            if (bytes_send < 1) break;
+            metricAdd(METRIC_BYTES_OUT, bytes_send);
+            continue;
+        }
+
+        if (c->sent == c->len) {    //Char device, copy it through the connection buffer
+            size_t chunk = c->rb.cap;
+            if (c->replay_end >= 0) {
+                if (c->replay_off >= c->replay_end) break;
+                if ((off_t) chunk > c->replay_end - c->replay_off) chunk = c->replay_end - c->replay_off;
+            }
+            ssize_t bytes_read = pread(file_fd, c->rb.buf, chunk, c->replay_off);
+            if (bytes_read == -1) syslog(LOG_ERR, "ERROR with replay read: %s", strerror(errno));
+            if (bytes_read < 1) break;
+            c->replay_off += bytes_read;
+            c->len = bytes_read;
+            c->sent = 0;
+        }
+
+        ssize_t bytes_send = send(c->fd, c->rb.buf + c->sent, c->len - c->sent, MSG_NOSIGNAL);
+        if (bytes_send == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;   //Socket buffer full, wait for EPOLLOUT
+            syslog(LOG_ERR, "ERROR with send: %s", strerror(errno));
+            break;
+        }
+        c->sent += bytes_send;
+        metricAdd(METRIC_BYTES_OUT, bytes_send);
+    }
+
+    metricReplay(c->replay_started);
+    connClose(c);   //Replay finished, the connection is done
+    return false;
+}
+
+static void connHandle(int epoll_fd, struct conn *c){
+    if (c->state == CONN_RECV && !connRecv(c)) return;
+
+    if (c->state == CONN_APPEND) {
+        c->rb.buf[c->len] = '\0';
+        c->replay_off = packetAppend(c->rb.buf, c->len, &c->replay_end, &c->len);     //Any resume header is sent first
+        c->sent = 0;
+        c->state = CONN_REPLAY;
+        c->replay_started = metricNow();
+
+        struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) == -1) {
+            syslog(LOG_ERR, "ERROR with epoll_ctl: %s", strerror(errno));
+            connClose(c);
+            return;
+        }
+    }
+
+    if (c->state == CONN_REPLAY) connReplay(c);
+}
+
+static void *reactorRoutine(void *arg){
+    int listen_fd = (int)(intptr_t)arg;
+    struct epoll_event events[EPOLL_EVENTS];
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        syslog(LOG_ERR, "ERROR with epoll_create: %s", strerror(errno));
+        kill(getpid(), SIGTERM);    //To the process, the signal thread is the only one taking it
+        return NULL;
+    }
+
+    //Every reactor watches the listening socket, EPOLLEXCLUSIVE wakes only one of them per connection
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+        syslog(LOG_ERR, "ERROR with epoll_ctl: %s", strerror(errno));
+        kill(getpid(), SIGTERM);
+        return NULL;
+    }
+
+    while (1) {
+        int count = epoll_wait(epoll_fd, events, EPOLL_EVENTS, -1);
+        if (count == -1) {
+            if (errno != EINTR) syslog(LOG_ERR, "ERROR with epoll_wait: %s", strerror(errno));
+            continue;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) connAccept(epoll_fd, listen_fd);
+            else connHandle(epoll_fd, (struct conn *)events[i].data.ptr);
+        }
+    }
+    return NULL;
+}
+
+void epollServe(int listen_fd){
+    struct rlimit limit;
+    pthread_t pthread;
+
+    //Each client costs a descriptor instead of a thread, so allow as many as the hard limit permits
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1) syslog(LOG_ERR, "ERROR with setrlimit: %s", strerror(errno));
+    }
+
+    int flags = fcntl(listen_fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        syslog(LOG_ERR, "ERROR setting listen socket non-blocking: %s", strerror(errno));
+        exit(1);
+    }
+
+    tmpfileOpen();
+
+    for (int i = 1; i < EPOLL_THREADS; i++) {
+        if (pthread_create(&pthread, NULL, reactorRoutine, (void *)(intptr_t)listen_fd) != 0) {
+            syslog(LOG_ERR, "ERROR with reactor pthread_create");
+            exit(1);
+        }
+        pthread_detach(pthread);
+    }
+    reactorRoutine((void *)(intptr_t)listen_fd);    //The calling thread becomes the first reactor
+    exit(EXIT_FAILURE);
+}
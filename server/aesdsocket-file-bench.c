@@ -0,0 +1,158 @@
+/*
+ * aesdsocket-file-bench.c
+ *
+ *  Contention benchmark for the aesdsocket data file. Runs writer threads
+ *  appending fixed size records and reader threads replaying the most recent
+ *  history into a drained local socket, all through the same fileAppend/fileReplay calls the
+ *  server uses, and reports appends and replays per second.
+ *  With -l every call is serialised on one mutex, as the server did before
+ *  appends reserved their offsets and replays stopped taking the lock.
+ *  Built with USE_PERSISTENT_LOG, every append also goes to a fresh log in
+ *  /tmp, removed again at the end. Built with USE_SEGMENTS, the data file
+ *  is a directory of segments subject to the usual retention.
+ *
+ *  Usage: aesdsocket-file-bench [-w writers] [-r readers] [-t seconds] [-s record bytes] [-b replay bytes] [-l]
+ */
+
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "aesdsocket.h"
+
+static atomic_bool running = true;
+static atomic_ulong appends, replays;
+static bool locked = false;
+static pthread_mutex_t benchMutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t record_size = 64, replay_window = 1 << 20;
+
+static void *writerRoutine(void *arg){
+    char *record = (char *)malloc(record_size);
+    memset(record, 'w', record_size - 1);
+    record[record_size - 1] = '\n';
+    (void)arg;
+
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        if (locked) pthread_mutex_lock(&benchMutex);
+        fileAppend(record, record_size);
+        if (locked) pthread_mutex_unlock(&benchMutex);
+        atomic_fetch_add_explicit(&appends, 1, memory_order_relaxed);
+    }
+    free(record);
+    return NULL;
+}
+
+//Plays the client side of a replay, reading and discarding until the reader closes its end
+static void *drainRoutine(void *arg){
+    int fd = (int)(intptr_t)arg;
+    char buf[65536];
+
+    while (read(fd, buf, sizeof buf) > 0);
+    close(fd);
+    return NULL;
+}
+
+static void *readerRoutine(void *arg){
+    int sock[2];
+    pthread_t drain;
+    (void)arg;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock) == -1) {
+        perror("socketpair");
+        return NULL;
+    }
+    pthread_create(&drain, NULL, drainRoutine, (void *)(intptr_t)sock[1]);
+
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        if (locked) pthread_mutex_lock(&benchMutex);
+        off_t end = fileCommitted();
+        off_t start = end > (off_t) replay_window ? end - (off_t) replay_window : 0;
+        fileReplay(sock[0], start, end);
+        if (locked) pthread_mutex_unlock(&benchMutex);
+        atomic_fetch_add_explicit(&replays, 1, memory_order_relaxed);
+    }
+    close(sock[0]);
+    pthread_join(drain, NULL);
+    return NULL;
+}
+
+//Remove the bench's log segments and their directory
+static void logRemove(){
+    DIR *dir = opendir(LOG_PATH);
+    struct dirent *entry;
+    char path[PATH_MAX];
+
+    if (dir == NULL) return;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof path, "%s/%s", LOG_PATH, entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+    rmdir(LOG_PATH);
+}
+
+int main(int argc, char *argv[]){
+    int writers = 1, readers = 1, seconds = 3, opt;
+
+    while ((opt = getopt(argc, argv, "w:r:t:s:b:l")) != -1) {
+        switch (opt) {
+        case 'w': writers = atoi(optarg); break;
+        case 'r': readers = atoi(optarg); break;
+        case 't': seconds = atoi(optarg); break;
+        case 's': record_size = strtoul(optarg, NULL, 0); break;
+        case 'b': replay_window = strtoul(optarg, NULL, 0); break;
+        case 'l': locked = true; break;
+        default:
+            fprintf(stderr, "Usage: %s [-w writers] [-r readers] [-t seconds] [-s record bytes] [-b replay bytes] [-l]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (record_size < 1) record_size = 1;
+
+    FILENAME = "/tmp/aesdsocket-file-bench.dat";   //Never touch the server's own data file
+    LOG_PATH = "/tmp/aesdsocket-file-bench.log";
+    fileRemove();
+    logRemove();
+    logOpen();
+    tmpfileOpen();
+
+    //Seed one replay window of history so readers have work from the start
+    char *seed = (char *)calloc(1, replay_window);
+    fileAppend(seed, replay_window);
+    free(seed);
+
+    pthread_t *threads = (pthread_t *)calloc(writers + readers, sizeof *threads);
+    for (int i = 0; i < writers + readers; i++) {
+        pthread_create(&threads[i], NULL, i < writers ? writerRoutine : readerRoutine, NULL);
+    }
+    sleep(seconds);
+    atomic_store(&running, false);
+    for (int i = 0; i < writers + readers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("%-8s%s%s writers %2d readers %2d  appends/s %10.0f  replays/s %8.1f\n",
+           locked ? "locked" : (USE_GROUP_COMMIT == 1) ? "group" : "lockless", (USE_PERSISTENT_LOG == 1) ? " logged" : "",
+           (USE_SEGMENTS == 1) ? " segmented" : "",
+           writers, readers, (double)appends / seconds, (double)replays / seconds);
+
+    if (USE_GROUP_COMMIT == 1) {
+        char stats[1024];
+        groupCommitStats(stats, sizeof stats);
+        printf("%s\n", stats);
+    }
+
+    free(threads);
+    close(file_fd);
+    fileRemove();
+    logRemove();
+    return 0;
+}
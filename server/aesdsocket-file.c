@@ -0,0 +1,435 @@
+/*
+ * aesdsocket-file.c
+ *
+ *  Data file handling for aesdsocket. In file mode the data file is append
+ *  only: a writer reserves a ticket and an offset with one atomic add and
+ *  writes its record with pwrite. It then marks the ticket finished, and
+ *  whichever writer finds the oldest ticket finished publishes the committed
+ *  length past every finished ticket in order. Readers replay up to the
+ *  committed length they load and never take a lock, so a slow client
+ *  reading a large history does not hold up any writer, and a writer never
+ *  waits for one that reserved before it.
+ *  The char device keeps fileMutex, its seek command moves the shared
+ *  file position.
+ *  With USE_SEGMENTS the offsets stay the same but the bytes live in the
+ *  segment files of aesdsocket-segment.c, each write and sendfile going to
+ *  the segment that holds its offset.
+ */
+
+#define _GNU_SOURCE    //splice
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syslog.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "aesd_ioctl.h"
+#include "aesdsocket.h"
+
+const char* FILENAME = (USE_AESD_CHAR_DEVICE == 1) ? "/dev/aesdchar" : "/var/tmp/aesdsocketdata";
+
+int file_fd = -1;
+pthread_mutex_t fileMutex = PTHREAD_MUTEX_INITIALIZER; //Serialises the char device, and opening the file
+
+#define COMMIT_TICKET_SHIFT 48      //Reservations and the committed length pack a 16 bit ticket above a 48 bit offset
+#define COMMIT_TICKET ((uint64_t) 1 << COMMIT_TICKET_SHIFT)
+#define COMMIT_OFFSET_MASK (COMMIT_TICKET - 1)
+#define COMMIT_RING 1024            //Tickets a writer may run ahead of the oldest unpublished one, a power of two
+#define COMMIT_SPINS 64             //Yields while waiting on the committed length before sleeping until it moves
+
+static _Atomic uint64_t file_reserved;     //Next ticket and end of the last reservation handed to a writer
+static _Atomic uint64_t file_committed;    //Next ticket to publish, everything before its offset is written
+static _Atomic uint64_t commit_done[COMMIT_RING];  //Ticket and length of each finished reservation, indexed by ticket
+static pthread_mutex_t committedMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t committedMoved = PTHREAD_COND_INITIALIZER;   //Broadcast when file_committed advances
+static _Atomic unsigned committed_waiters;  //Sleeping on committedMoved, publishers only take the lock if nonzero
+static _Atomic uint64_t file_epoch;        //Names the history offsets count in, picked when it starts empty
+
+static uint16_t commitTicket(uint64_t packed){
+    return (uint16_t)(packed >> COMMIT_TICKET_SHIFT);
+}
+
+//Wait for file_committed to move on from seen. The writer holding it up is usually about to publish, so yield
+//COMMIT_SPINS times first, then sleep so a writer stalled on a slow disk does not keep every other one spinning
+static void committedWait(uint64_t seen, unsigned *spins){
+    if (++*spins < COMMIT_SPINS) {
+        sched_yield();
+        return;
+    }
+    pthread_mutex_lock(&committedMutex);
+    atomic_fetch_add(&committed_waiters, 1);    //Seen by a publisher advancing after this, or the load below sees it
+    while (atomic_load(&file_committed) == seen) pthread_cond_wait(&committedMoved, &committedMutex);
+    atomic_fetch_sub(&committed_waiters, 1);
+    pthread_mutex_unlock(&committedMutex);
+}
+
+void tmpfileOpen(){
+    if (file_fd >= 0) return;
+
+    metricLock(&fileMutex, METRIC_FILE_WAIT_NS);    //Several clients may arrive at once, only the first opens the file
+    if (file_fd < 0) {
+        struct stat st;
+        int fd;
+        //The data file is written at reserved offsets with pwrite, which O_APPEND would ignore
+        int flags = (USE_AESD_CHAR_DEVICE == 1) ? (O_CREAT | O_RDWR | O_APPEND) : (O_CREAT | O_RDWR);
+        if (USE_SEGMENTS == 1) {    //FILENAME is the directory of segments, file_fd refers to it
+            fd = (mkdir(FILENAME, 0755) == 0 || errno == EEXIST) ? open(FILENAME, O_RDONLY | O_DIRECTORY) : -1;
+        }
+        else {
+            fd = open(FILENAME, flags, 0644);
+        }
+        if (fd < 0) {
+            syslog(LOG_ERR, "ERROR with file open");
+            pthread_mutex_unlock(&fileMutex);
+            kill(getpid(), SIGINT);     //To the process, the signal thread is the only one taking it
+            return;
+        }
+        if (USE_SEGMENTS == 1) {
+            off_t end = segmentsOpen(fd);       //Continue after the newest segment
+            atomic_store(&file_reserved, (uint64_t) end);
+            atomic_store(&file_committed, (uint64_t) end);
+        }
+        else if (USE_AESD_CHAR_DEVICE == 0 && fstat(fd, &st) == 0) {
+            atomic_store(&file_reserved, (uint64_t) st.st_size);   //Continue after anything already in the file
+            atomic_store(&file_committed, (uint64_t) st.st_size);
+        }
+        file_fd = fd;
+    }
+    pthread_mutex_unlock(&fileMutex);
+}
+
+void fileRemove(){
+    if (USE_SEGMENTS == 1) {
+        segmentsRemove();
+        if (rmdir(FILENAME) == -1) syslog(LOG_ERR, "%s: %m", "Error deleting data segment directory");
+        return;
+    }
+    if ((unlink(FILENAME)) == -1 ) syslog(LOG_ERR, "%s: %m", "Error deleting tmp file");   //Delete the tmp file we created and log if error
+}
+
+uint64_t fileEpoch(){
+    uint64_t epoch = atomic_load(&file_epoch);
+    if (epoch == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        uint64_t fresh = ((uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec) | 1;  //Never 0
+        //The first caller picks it, the others get the winner's back in epoch
+        if (atomic_compare_exchange_strong(&file_epoch, &epoch, fresh)) epoch = fresh;
+    }
+    return epoch;
+}
+
+void fileReset(off_t base, uint64_t epoch){
+    atomic_store(&file_epoch, epoch);
+    tmpfileOpen();
+    if (USE_SEGMENTS == 1) {
+        segmentsReset(base);
+    }
+    else {
+        base = 0;
+        if (ftruncate(file_fd, 0) == -1) syslog(LOG_ERR, "ERROR with data file truncate: %s", strerror(errno));
+    }
+    atomic_store(&file_reserved, (uint64_t) base);
+    atomic_store(&file_committed, (uint64_t) base);
+}
+
+//Write at offset, in segment mode to the segment holding it. Returns as pwritev, stopping at the end of a segment
+static ssize_t fileWriteAt(const struct iovec *iov, int iovcnt, off_t offset){
+    if (USE_SEGMENTS == 0) return pwritev(file_fd, iov, iovcnt, offset);
+
+    off_t limit;
+    int fd = segmentWriteFd(offset, &limit);
+    if (fd < 0) return -1;
+    struct iovec part[iovcnt];      //The part of iov that fits in this segment
+    int parts = 0;
+    for (size_t room = limit - offset; parts < iovcnt && room > 0; parts++) {
+        part[parts] = iov[parts];
+        if (part[parts].iov_len > room) part[parts].iov_len = room;
+        room -= part[parts].iov_len;
+    }
+    return pwritev(fd, part, parts, offset - (limit - (off_t) SEGMENT_SIZE));
+}
+
+//Write the len bytes of iov, which is modified, at offset
+static void fileWrite(struct iovec *iov, int iovcnt, off_t offset, size_t len){
+    off_t end = offset + (off_t) len;
+    while (iovcnt > 0 && offset < end) {
+        ssize_t bytes_written = fileWriteAt(iov, iovcnt, offset);
+        if (bytes_written == -1 && errno == EINTR) continue;
+        if (bytes_written < 1) {
+            syslog(LOG_ERR, "ERROR with write: %s", strerror(errno));
+            break;      //Still publish after, later writers are queued behind this ticket
+        }
+        offset += bytes_written;
+        while (iovcnt > 0 && (size_t) bytes_written >= iov->iov_len) {  //Step past what a short write did finish
+            bytes_written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + bytes_written;
+            iov->iov_len -= bytes_written;
+        }
+    }
+}
+
+void fileRestore(const char *buf, size_t len){
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    uint16_t ticket;
+
+    if (len == 0) return;
+    off_t offset = fileReserve(len, &ticket);
+    fileWrite(&iov, 1, offset, len);
+    filePublish(ticket, len);
+}
+
+off_t fileAppend(const char *buf, size_t len){
+    if (USE_GROUP_COMMIT == 1) {
+        return groupCommit(buf, len);      //The writer thread batches it with other clients' packets
+    }
+
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    return fileAppendv(&iov, 1);
+}
+
+off_t fileAppendv(struct iovec *iov, int iovcnt){
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+
+    if (USE_AESD_CHAR_DEVICE == 1) {
+        uint64_t sequence = 0;
+        metricLock(&fileMutex, METRIC_FILE_WAIT_NS);
+        if (USE_PERSISTENT_LOG == 1) sequence = logAppend(iov, iovcnt, len, NULL, NULL);   //In the order the device gets them
+        if (writev(file_fd, iov, iovcnt) != (ssize_t) len) syslog(LOG_ERR, "ERROR with write: %s", strerror(errno));
+        pthread_mutex_unlock(&fileMutex);
+        logWait(sequence);
+        return -1;
+    }
+
+    if (len == 0) return 0;
+
+    uint16_t ticket;
+    uint64_t sequence = 0;
+    off_t offset;
+    if (USE_PERSISTENT_LOG == 1) sequence = logAppend(iov, iovcnt, len, &ticket, &offset);    //Copied before pwritev moves iov on
+    else offset = fileReserve(len, &ticket);
+    off_t end = offset + (off_t) len;
+    fileWrite(iov, iovcnt, offset, len);
+    filePublish(ticket, len);
+    logWait(sequence);
+    return end;
+}
+
+off_t fileReserve(size_t len, uint16_t *ticket){
+    uint64_t reservation = atomic_fetch_add(&file_reserved, COMMIT_TICKET + len);
+    *ticket = commitTicket(reservation);
+
+    //Only wait if a stalled writer has let this one get a full ring of tickets ahead of it
+    uint64_t committed;
+    unsigned spins = 0;
+    while ((uint16_t)(*ticket - commitTicket(committed = atomic_load(&file_committed))) >= COMMIT_RING) {
+        committedWait(committed, &spins);
+    }
+    return (off_t)(reservation & COMMIT_OFFSET_MASK);
+}
+
+void filePublish(uint16_t ticket, size_t len){
+    //Mark this ticket finished, then publish as far as the finished tickets reach. The seq_cst store and load pair
+    //with the committing writer's, so either it sees this ticket finished or this writer sees it was committed.
+    atomic_store(&commit_done[ticket & (COMMIT_RING - 1)], ((uint64_t) ticket << COMMIT_TICKET_SHIFT) | len);
+    uint64_t committed = atomic_load(&file_committed);
+    bool advanced = false;
+    while (1) {
+        uint16_t head = commitTicket(committed);
+        uint64_t done = atomic_load(&commit_done[head & (COMMIT_RING - 1)]);
+        if (commitTicket(done) != head || (done & COMMIT_OFFSET_MASK) == 0) break;    //Oldest ticket is still writing, it publishes
+        uint64_t next = committed + COMMIT_TICKET + (done & COMMIT_OFFSET_MASK);
+        if (atomic_compare_exchange_weak(&file_committed, &committed, next)) {
+            committed = next;
+            advanced = true;
+        }
+    }
+    if (advanced && atomic_load(&committed_waiters) > 0) {
+        pthread_mutex_lock(&committedMutex);
+        pthread_cond_broadcast(&committedMoved);
+        pthread_mutex_unlock(&committedMutex);
+    }
+}
+
+void fileWaitCommitted(off_t end){
+    uint64_t committed;
+    unsigned spins = 0;
+
+    if (USE_AESD_CHAR_DEVICE == 1) return;     //Appends to the device are done when write returns
+    while ((off_t)((committed = atomic_load(&file_committed)) & COMMIT_OFFSET_MASK) < end) {
+        committedWait(committed, &spins);
+    }
+}
+
+off_t fileCommitted(){
+    if (USE_AESD_CHAR_DEVICE == 1) return -1;  //The char device has no fixed size, replay it until read returns 0
+    return (off_t)(atomic_load(&file_committed) & COMMIT_OFFSET_MASK);
+}
+
+off_t packetAppend(char *packet, size_t len, off_t *replay_end, size_t *header_len){
+    off_t replay_start = 0;
+
+    *header_len = 0;
+    if (len > 18 && strncmp(packet, "AESDSOCKET_RESUME:", 18) == 0){    //Client only wants what was added since its offset
+        char *rest = NULL;
+        long long resume = strtoll(packet + 18, &rest, 10);
+        uint64_t resume_epoch = (*rest == ',') ? strtoull(rest + 1, NULL, 10) : 0;
+        //Offsets given to clients are positions in the history named by epoch, they keep naming the same byte
+        //while older bytes are dropped. start is where file offset 0 is, the oldest byte the char device holds
+        struct aesd_range range = { 0 };
+        int64_t offset = -1;
+
+        if (USE_AESD_CHAR_DEVICE == 1){
+            metricLock(&fileMutex, METRIC_FILE_WAIT_NS);
+            if (ioctl(file_fd, AESDCHAR_IOCGETRANGE, (unsigned long)&range) == -1){
+                syslog(LOG_ERR, "ERROR with range ioctl, resume is not possible: %s", strerror(errno));
+                range = (struct aesd_range) { 0 };     //Epoch 0 matches no client, every resume gets it all
+            }
+            pthread_mutex_unlock(&fileMutex);
+        }
+        else {
+            range.end = (uint64_t) fileCommitted();     //Offsets below retention carry on from the oldest segment
+            range.epoch = fileEpoch();
+        }
+        if (range.epoch != 0 && resume_epoch == range.epoch && resume >= 0) offset = aesd_range_offset(&range, resume);
+        //Another history, or bytes the device has dropped since, start over from the oldest byte held
+        replay_start = (offset >= 0) ? (off_t) offset : 0;
+        *header_len = snprintf(packet, RESUME_HEADER, "AESDSOCKET_END:%llu,%llu\n",
+                               (unsigned long long) range.end, (unsigned long long) range.epoch);
+        *replay_end = (range.epoch != 0) ? (off_t)(range.end - range.start) : fileCommitted();   //Unknown range, all of it
+        return replay_start;
+    }
+
+    if (len > 19 && strncmp(packet, "AESDCHAR_IOCSEEKTO:", 19) == 0){   //Packet is an ioctl command rather than data
+        struct aesd_seekto seekto = { 0 };
+        char *saveptr = NULL;
+        char *cmdToken = strtok_r(packet + 19, ",", &saveptr);
+        if (cmdToken != NULL) seekto.write_cmd = atoi(cmdToken);
+        cmdToken = strtok_r(NULL, ",", &saveptr);
+        if (cmdToken != NULL) seekto.write_cmd_offset = atoi(cmdToken);
+
+        if (USE_SEGMENTS == 1){     //The segment index finds the line, counted from the oldest one held
+            replay_start = segmentSeek(seekto.write_cmd, seekto.write_cmd_offset);
+            if (replay_start == (off_t) -1){
+                syslog(LOG_ERR, "ERROR seeking to line %u offset %u", seekto.write_cmd, seekto.write_cmd_offset);
+                replay_start = 0;
+            }
+        }
+        else {
+            metricLock(&fileMutex, METRIC_FILE_WAIT_NS);    //Hold the shared file position until it has been read back
+            if (ioctl(file_fd, AESDCHAR_IOCSEEKTO, (unsigned long)&seekto) == -1){
+                syslog(LOG_ERR, "ERROR with ioctl: %s", strerror(errno));
+            }
+            replay_start = lseek(file_fd, 0, SEEK_CUR);    //Replay from wherever the command left the file position
+            pthread_mutex_unlock(&fileMutex);
+            if (replay_start == (off_t) -1) replay_start = 0;
+        }
+    }
+    else {
+        off_t end = fileAppend(packet, len);
+        //A writer that reserved earlier may still be writing, wait until the packet is part of what gets replayed
+        fileWaitCommitted(end);
+        metricAdd(METRIC_PACKETS, 1);
+    }
+
+    *replay_end = fileCommitted();  //Snapshot the length so later appends are not part of this replay
+    return replay_start;
+}
+
+ssize_t fileSendfile(int sock_fd, off_t *offset, off_t end){
+    if (USE_SEGMENTS == 0) return sendfile(sock_fd, file_fd, offset, end - *offset);
+
+    off_t limit;
+    int fd = segmentReadFd(offset, &limit);     //Replays move through the history one segment at a time
+    if (fd < 0) return (*offset >= end) ? 0 : -1;
+    off_t pos = *offset - (limit - (off_t) SEGMENT_SIZE);
+    ssize_t bytes_send = (*offset < end) ? sendfile(sock_fd, fd, &pos, (limit < end ? limit : end) - *offset) : 0;
+    if (bytes_send > 0) *offset += bytes_send;
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return bytes_send;
+}
+
+void fileReplay(int sock_fd, off_t offset, off_t end){
+    if (USE_AESD_CHAR_DEVICE == 0){  //Regular file, the kernel copies straight from the page cache to the socket
+        while (offset < end){
+            ssize_t bytes_send = fileSendfile(sock_fd, &offset, end);
+            if (bytes_send == -1 && errno == EINTR) continue;
+            if (bytes_send < 1){
+                if (bytes_send == -1) syslog(LOG_ERR, "ERROR with sendfile: %s", strerror(errno));
+                return;
+            }
+            metricAdd(METRIC_BYTES_OUT, bytes_send);
+        }
+        return;
+    }
+
+    int pipe_fd[2];
+    bool spliced = false;
+    if (pipe(pipe_fd) == 0){    //Char device, move its pages through a pipe into the socket
+        while (end < 0 || offset < end){
+            size_t chunk = (end >= 0 && end - offset < REPLAY_CHUNK) ? (size_t)(end - offset) : REPLAY_CHUNK;
+            ssize_t bytes_read = splice(file_fd, &offset, pipe_fd[1], NULL, chunk, SPLICE_F_MOVE);
+            if (bytes_read == -1 && errno == EINTR) continue;
+            if (bytes_read < 1){
+                spliced = spliced || bytes_read == 0;
+                if (bytes_read == -1 && errno != EINVAL) syslog(LOG_ERR, "ERROR with splice: %s", strerror(errno));
+                break;
+            }
+            spliced = true;
+            while (bytes_read > 0){
+                ssize_t bytes_send = splice(pipe_fd[0], NULL, sock_fd, NULL, bytes_read, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (bytes_send == -1 && errno == EINTR) continue;
+                if (bytes_send < 1){
+                    syslog(LOG_ERR, "ERROR with splice to socket: %s", strerror(errno));
+                    close(pipe_fd[0]);
+                    close(pipe_fd[1]);
+                    return;
+                }
+                bytes_read -= bytes_send;
+                metricAdd(METRIC_BYTES_OUT, bytes_send);
+            }
+        }
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+    }
+    if (spliced) return;
+
+    //A driver built without splice_read, copy through a buffer instead
+    char *textbuff = (char*) malloc(BUFFER);
+    if (textbuff == NULL){
+        syslog(LOG_ERR, "ERROR with replay malloc");
+        return;
+    }
+    ssize_t bytes_read;
+    while (end < 0 || offset < end){
+        size_t chunk = (end >= 0 && end - offset < BUFFER) ? (size_t)(end - offset) : BUFFER;
+        if ((bytes_read = pread(file_fd, textbuff, chunk, offset)) < 1) break;
+        offset += bytes_read;
+        if (send(sock_fd, textbuff, bytes_read, MSG_NOSIGNAL) != bytes_read){
+            syslog(LOG_ERR, "ERROR with send: %s", strerror(errno));
+            break;
+        }
+        metricAdd(METRIC_BYTES_OUT, bytes_read);
+    }
+    free(textbuff);
+}
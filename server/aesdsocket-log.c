@@ -0,0 +1,473 @@
+/*
+ * aesdsocket-log.c
+ *
+ *  Persistent log for aesdsocket, used when USE_PERSISTENT_LOG is set. Every
+ *  append is also copied into a memory-mapped segment file in LOG_PATH as a
+ *  record of its length, a CRC-32 and the bytes. Segments are preallocated
+ *  LOG_SEGMENT_SIZE bytes and a new one is started once a record does not
+ *  fit. A sync thread writes the mapped pages back at most LOG_SYNC_MS after
+ *  an append, or as soon as LOG_SYNC_BYTES are waiting, so one msync covers
+ *  many appends. With LOG_SYNC_MS 0 every append waits for the sync that
+ *  covers it.
+ *
+ *  On start logOpen scans the segments in order, stops at the first record
+ *  that is torn or fails its CRC, clears everything after it and refills the
+ *  data file, or an emptied char device, with the records that survived.
+ *  With USE_SEGMENTS the data file forgets its oldest bytes, and logTrim
+ *  deletes the log segments holding nothing newer, so the log is bounded by
+ *  the same retention. An append the log cannot take, a new segment failing
+ *  on a full disk say, stops the log so it never restores around a hole.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syslog.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "aesdsocket.h"
+
+#define LOG_MAGIC 0x31474f4c44534541ULL    //"AESDLOG1" read as a little endian number
+#define LOG_HEADER_SIZE 64                  //Bytes before the first record of a segment
+#define LOG_ALIGN 8                         //Records start at multiples of this
+#define LOG_RECORD_MAX (1UL << 31)          //Largest record, the length field has to stay clear of torn values
+
+const char* LOG_PATH = LOG_DIR;
+
+struct log_header {     //Start of every segment file
+    uint64_t magic;
+    uint64_t base;      //Data file offset of the segment's first record
+    uint64_t epoch;     //log_epoch, the same in every segment
+    uint32_t sequence;  //Number in the file name, one more than the previous segment's
+    uint32_t crc;       //Of the fields above
+};
+
+struct log_record {     //Precedes the bytes of every record, a zero length marks the end of the segment
+    uint32_t len;
+    uint32_t crc;       //Of the length and the bytes
+};
+
+struct log_segment {
+    int fd;
+    char *map;
+    size_t size;        //Bytes mapped, the whole file
+    size_t used;        //End of the last record
+    size_t synced;      //Bytes before this are known to be on disk
+    uint32_t sequence;
+    struct log_segment *next;   //Retired segments waiting for their last sync
+};
+
+static pthread_mutex_t logMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logSync;          //Wakes the sync thread, monotonic clock for its interval
+static pthread_cond_t logDurable = PTHREAD_COND_INITIALIZER;
+
+static struct log_segment *current = NULL;  //Segment appends go to
+static struct log_segment *retired = NULL;  //Full segments the sync thread still has to flush and unmap
+static uint64_t log_bytes = 0;              //Data bytes in the log, the data file offset of the next record
+static uint64_t appended = 0;               //Records appended, logAppend hands out the count as a sequence number
+static uint64_t durable = 0;                //Records known to be on disk
+static uint64_t log_epoch = 0;              //In every segment header, in file mode also the data file's fileEpoch
+static bool recovered = false;              //logOpen is done, logTrim may look at the segments
+static bool broken = false;                 //An append missed the log, no later record may follow it
+static uint32_t crc_table[256];
+
+static void crcInit(){
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+        crc_table[i] = crc;
+    }
+}
+
+//CRC-32 as used by zlib, continue by passing the previous result as crc, start from 0
+static uint32_t crcUpdate(uint32_t crc, const void *buf, size_t len){
+    const unsigned char *p = buf;
+    crc = ~crc;
+    while (len--) crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static size_t recordSize(size_t len){
+    return (sizeof(struct log_record) + len + LOG_ALIGN - 1) & ~(size_t)(LOG_ALIGN - 1);
+}
+
+static uint32_t headerCrc(const struct log_header *header){
+    return crcUpdate(0, header, offsetof(struct log_header, crc));
+}
+
+static void segmentName(char *path, size_t size, uint32_t sequence){
+    snprintf(path, size, "%s/%08u.log", LOG_PATH, sequence);
+}
+
+//Write back bytes from..to of a segment, msync needs a page aligned start
+static void segmentSync(struct log_segment *segment, size_t from, size_t to){
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    from &= ~(page - 1);
+    if (to > from && msync(segment->map + from, to - from, MS_SYNC) == -1) {
+        syslog(LOG_ERR, "ERROR with log msync: %s", strerror(errno));
+    }
+}
+
+static void segmentFree(struct log_segment *segment){
+    munmap(segment->map, segment->size);
+    close(segment->fd);
+    free(segment);
+}
+
+static struct log_segment *segmentMap(int fd, size_t size, uint32_t sequence){
+    struct log_segment *segment = (struct log_segment *)calloc(1, sizeof *segment);
+    if (segment == NULL) return NULL;
+    segment->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (segment->map == MAP_FAILED) {
+        free(segment);
+        return NULL;
+    }
+    segment->fd = fd;
+    segment->size = size;
+    segment->sequence = sequence;
+    return segment;
+}
+
+//Start the segment after the current one with room for a record of need bytes, logMutex held
+static bool segmentStart(size_t need){
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t size = LOG_HEADER_SIZE + need > LOG_SEGMENT_SIZE ? LOG_HEADER_SIZE + need : LOG_SEGMENT_SIZE;
+    uint32_t sequence = (current != NULL) ? current->sequence + 1 : 1;
+    char path[PATH_MAX];
+
+    size = (size + page - 1) & ~(page - 1);
+    segmentName(path, sizeof path, sequence);
+    int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) {
+        syslog(LOG_ERR, "ERROR creating log segment %s: %s", path, strerror(errno));
+        return false;
+    }
+    //Allocate the blocks now, a mapped write to a sparse file on a full disk would raise SIGBUS
+    int result = posix_fallocate(fd, 0, size);
+    struct log_segment *segment = (result == 0) ? segmentMap(fd, size, sequence) : NULL;
+    if (segment == NULL) {
+        syslog(LOG_ERR, "ERROR preparing log segment %s: %s", path, strerror(result ? result : errno));
+        close(fd);
+        unlink(path);
+        return false;
+    }
+
+    struct log_header *header = (struct log_header *) segment->map;
+    header->magic = LOG_MAGIC;
+    header->base = log_bytes;
+    header->epoch = log_epoch;
+    header->sequence = sequence;
+    header->crc = headerCrc(header);
+    segment->used = LOG_HEADER_SIZE;
+
+    int dir_fd = open(LOG_PATH, O_RDONLY | O_DIRECTORY);     //Make the new file name durable too
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    if (current != NULL) {      //The sync thread flushes what is left of it and unmaps it
+        current->next = retired;
+        retired = current;
+    }
+    current = segment;
+    pthread_cond_signal(&logSync);
+    return true;
+}
+
+static void *syncRoutine(void *arg){
+    (void)arg;
+
+    pthread_mutex_lock(&logMutex);
+    while (1) {
+        if (LOG_SYNC_MS > 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += (LOG_SYNC_MS % 1000) * 1000000L;
+            deadline.tv_sec += LOG_SYNC_MS / 1000 + deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            while (retired == NULL && current->used - current->synced < LOG_SYNC_BYTES) {
+                if (pthread_cond_timedwait(&logSync, &logMutex, &deadline) == ETIMEDOUT) break;
+            }
+        }
+        else {
+            while (retired == NULL && appended == durable) pthread_cond_wait(&logSync, &logMutex);
+        }
+
+        //Flush outside the lock, appends keep going meanwhile. Only this thread unmaps segments
+        struct log_segment *segment = current, *done = retired;
+        size_t from = segment->synced, to = segment->used;
+        uint64_t covered = appended;
+        retired = NULL;
+        pthread_mutex_unlock(&logMutex);
+
+        while (done != NULL) {
+            struct log_segment *next = done->next;
+            segmentSync(done, done->synced, done->used);
+            segmentFree(done);
+            done = next;
+        }
+        segmentSync(segment, from, to);
+
+        pthread_mutex_lock(&logMutex);
+        segment->synced = to;
+        durable = covered;
+        pthread_cond_broadcast(&logDurable);
+    }
+    return NULL;
+}
+
+//Give a recovered record back to the history, returns false if it could not be written
+static bool recordRestore(int fd, const char *buf, size_t len){
+    if (USE_AESD_CHAR_DEVICE == 1) {
+        //The driver keeps each write as one entry, so give every line its own segment like the original writes
+        struct iovec iov[64];
+        int count = 0;
+        while (len > 0) {
+            const char *newline = memchr(buf, '\n', len);
+            size_t line = newline ? (size_t)(newline - buf) + 1 : len;
+            iov[count].iov_base = (void *)buf;
+            iov[count].iov_len = line;
+            count++;
+            buf += line;
+            len -= line;
+            if (count == 64 || len == 0) {
+                if (writev(fd, iov, count) < 0) return false;
+                count = 0;
+            }
+        }
+        return true;
+    }
+    fileRestore(buf, len);
+    return true;
+}
+
+static int sequenceFilter(const struct dirent *entry){
+    unsigned sequence;
+    char tail;
+    return sscanf(entry->d_name, "%8u.lo%c", &sequence, &tail) == 2 && tail == 'g' && strlen(entry->d_name) == 12;
+}
+
+//Scan segment records from the header on, restoring each one to fd, returns false if the segment ends torn
+static bool segmentRecover(struct log_segment *segment, int fd, unsigned long *records){
+    size_t pos = LOG_HEADER_SIZE;
+
+    while (pos + sizeof(struct log_record) <= segment->size) {
+        struct log_record *record = (struct log_record *)(segment->map + pos);
+        if (record->len == 0) break;    //Clean end of the segment
+        if (record->len > segment->size - pos - sizeof(struct log_record) ||
+            crcUpdate(crcUpdate(0, &record->len, sizeof record->len), record + 1, record->len) != record->crc) {
+            //Torn or never fully written, clear the rest so nothing behind it can be read as a record later
+            syslog(LOG_WARNING, "Log segment %08u torn at %zu, truncating", segment->sequence, pos);
+            memset(segment->map + pos, 0, segment->size - pos);
+            segmentSync(segment, pos, segment->size);
+            segment->used = segment->synced = pos;
+            return false;
+        }
+        if (fd >= 0 && !recordRestore(fd, (const char *)(record + 1), record->len)) {
+            syslog(LOG_ERR, "ERROR restoring history: %s", strerror(errno));
+            fd = -1;    //Keep scanning so the log itself is still recovered
+        }
+        log_bytes += record->len;
+        (*records)++;
+        pos += recordSize(record->len);
+    }
+    segment->used = segment->synced = pos;
+    return true;
+}
+
+//Open the history that recovered records are written to, -1 if they should not be
+static int restoreOpen(){
+    if (USE_AESD_CHAR_DEVICE == 1) {
+        int fd = open(FILENAME, O_RDWR);
+        if (fd >= 0 && lseek(fd, 0, SEEK_END) > 0) {    //The driver still holds its history, only a reload empties it
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    tmpfileOpen();      //Rebuilt from the log through fileReset, whatever a crash left in it
+    return file_fd;
+}
+
+void logOpen(){
+    struct dirent **names = NULL;
+    unsigned long records = 0;
+    bool torn = false;
+    pthread_condattr_t attr;
+    pthread_t pthread;
+
+    if (USE_PERSISTENT_LOG == 0) return;
+
+    crcInit();
+    if (mkdir(LOG_PATH, 0755) == -1 && errno != EEXIST) {
+        syslog(LOG_ERR, "ERROR creating log directory %s: %s", LOG_PATH, strerror(errno));
+        exit(1);
+    }
+
+    int restore_fd = restoreOpen();
+    int count = scandir(LOG_PATH, &names, sequenceFilter, alphasort);     //Fixed width names sort in sequence order
+    for (int i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        struct stat st;
+        unsigned sequence = (unsigned) strtoul(names[i]->d_name, NULL, 10);
+        struct log_segment *segment = NULL;
+
+        segmentName(path, sizeof path, sequence);
+        if (!torn) {
+            int fd = open(path, O_RDWR);
+            if (fd >= 0 && fstat(fd, &st) == 0 && (size_t) st.st_size >= LOG_HEADER_SIZE) {
+                segment = segmentMap(fd, st.st_size, sequence);
+            }
+            if (segment == NULL && fd >= 0) close(fd);
+        }
+        struct log_header *header = segment ? (struct log_header *) segment->map : NULL;
+        if (header == NULL || header->magic != LOG_MAGIC || header->crc != headerCrc(header) ||
+            header->sequence != sequence || (current != NULL && sequence != current->sequence + 1) ||
+            (current != NULL && (header->base != log_bytes || header->epoch != log_epoch))) {
+            //Only a log with nothing missing in between is replayed, drop whatever follows a gap or a torn segment
+            if (!torn) syslog(LOG_WARNING, "Log segment %s does not continue the log, dropping it and any later ones", path);
+            torn = true;
+            if (segment != NULL) segmentFree(segment);
+            unlink(path);
+            free(names[i]);
+            continue;
+        }
+        if (current == NULL) {      //Older segments may have been trimmed, the history starts at the first one left
+            log_bytes = header->base;
+            log_epoch = header->epoch;  //Resume offsets given out before the restart stay valid
+            if (USE_AESD_CHAR_DEVICE == 0) fileReset(header->base, log_epoch);
+        }
+        torn = !segmentRecover(segment, restore_fd, &records);
+        if (current != NULL) segmentFree(current);  //Recovered, nothing left to sync
+        current = segment;
+        free(names[i]);
+    }
+    free(names);
+    if (current == NULL && USE_AESD_CHAR_DEVICE == 0) fileReset(0, 0);
+    if (log_epoch == 0) log_epoch = fileEpoch();    //A new history, file mode has just picked its epoch
+    if (USE_AESD_CHAR_DEVICE == 1 && restore_fd >= 0) close(restore_fd);
+    syslog(LOG_INFO, "Restored %lu records, %llu bytes from the log", records, (unsigned long long) log_bytes);
+
+    pthread_mutex_lock(&logMutex);
+    if (current == NULL && !segmentStart(0)) exit(1);
+    recovered = true;
+    pthread_mutex_unlock(&logMutex);
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&logSync, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&pthread, NULL, syncRoutine, NULL) != 0) {
+        syslog(LOG_ERR, "ERROR with log sync pthread_create");
+        exit(1);
+    }
+    pthread_detach(pthread);
+}
+
+uint64_t logAppend(const struct iovec *iov, int iovcnt, size_t len, uint16_t *ticket, off_t *offset){
+    if (ticket != NULL && USE_PERSISTENT_LOG == 0) {
+        *offset = fileReserve(len, ticket);
+        return 0;
+    }
+
+    pthread_mutex_lock(&logMutex);
+    if (ticket != NULL) *offset = fileReserve(len, ticket);     //Taken in log order, so both keep the same order
+    if (len == 0 || broken) {
+        pthread_mutex_unlock(&logMutex);
+        return 0;
+    }
+
+    size_t need = recordSize(len);
+    if (len >= LOG_RECORD_MAX || (current->used + need > current->size && !segmentStart(need))) {
+        //Still in the data file, but a later segment's base would skip it and a restart would restore around the
+        //hole. Stop the log here instead, it restores the history up to this append and nothing after it
+        if (len >= LOG_RECORD_MAX) syslog(LOG_ERR, "ERROR record of %zu bytes is too large for the log", len);
+        syslog(LOG_ERR, "ERROR log stopped at %llu bytes, later appends are lost on a restart",
+               (unsigned long long) log_bytes);
+        broken = true;
+        pthread_mutex_unlock(&logMutex);
+        return 0;
+    }
+
+    struct log_record *record = (struct log_record *)(current->map + current->used);
+    char *dest = (char *)(record + 1);
+    uint32_t crc = crcUpdate(0, &len, sizeof record->len);
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+        crc = crcUpdate(crc, dest, iov[i].iov_len);
+        dest += iov[i].iov_len;
+    }
+    record->crc = crc;
+    record->len = (uint32_t) len;   //The rest of the segment is zero, the record after it reads as the end
+    current->used += need;
+    log_bytes += len;
+    uint64_t sequence = ++appended;
+    if (LOG_SYNC_MS == 0 || current->used - current->synced >= LOG_SYNC_BYTES) pthread_cond_signal(&logSync);
+    pthread_mutex_unlock(&logMutex);
+    return sequence;
+}
+
+void logTrim(off_t start){
+    struct dirent **names = NULL;
+    char path[PATH_MAX];
+
+    if (USE_PERSISTENT_LOG == 0) return;
+
+    pthread_mutex_lock(&logMutex);
+    if (!recovered) {       //Retention started while the history was still being restored
+        pthread_mutex_unlock(&logMutex);
+        return;
+    }
+    uint32_t newest = current->sequence;
+    pthread_mutex_unlock(&logMutex);
+
+    //A segment is only needed while the one after it starts past start
+    int count = scandir(LOG_PATH, &names, sequenceFilter, alphasort);
+    bool trimming = true;
+    for (int i = 0; i < count; i++) {
+        if (trimming && i + 1 < count) {
+            struct log_header header;
+            unsigned next = (unsigned) strtoul(names[i + 1]->d_name, NULL, 10);
+            segmentName(path, sizeof path, next);
+            int fd = open(path, O_RDONLY);
+            trimming = fd >= 0 && next <= newest && pread(fd, &header, sizeof header, 0) == (ssize_t) sizeof header &&
+                       header.magic == LOG_MAGIC && header.crc == headerCrc(&header) && header.base <= (uint64_t) start;
+            if (fd >= 0) close(fd);
+            if (trimming) {
+                snprintf(path, sizeof path, "%s/%s", LOG_PATH, names[i]->d_name);
+                if (unlink(path) == -1) syslog(LOG_ERR, "ERROR deleting log segment %s: %s", path, strerror(errno));
+            }
+        }
+        free(names[i]);
+    }
+    free(names);
+}
+
+void logWait(uint64_t sequence){
+    if (USE_PERSISTENT_LOG == 0 || LOG_SYNC_MS > 0 || sequence == 0) return;
+
+    metricLock(&logMutex, METRIC_LOG_WAIT_NS);
+    while (durable < sequence) pthread_cond_wait(&logDurable, &logMutex);
+    pthread_mutex_unlock(&logMutex);
+}
+
+void logClose(){
+    if (USE_PERSISTENT_LOG == 0 || current == NULL) return;
+    //Called on the way out without taking logMutex, a record still being copied fails its CRC on the next start
+    for (struct log_segment *segment = retired; segment != NULL; segment = segment->next) {
+        segmentSync(segment, segment->synced, segment->used);
+    }
+    segmentSync(current, current->synced, current->used);
+}
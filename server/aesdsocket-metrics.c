@@ -0,0 +1,249 @@
+/*
+ * aesdsocket-metrics.c
+ *
+ *  Runtime counters for aesdsocket, served in the Prometheus text format on
+ *  METRICS_PORT of the loopback interface. Every thread counts into a slot of
+ *  its own, so the hot path is a relaxed load and store on a cache line no
+ *  other thread writes. Slots are only ever added to a lock-free list and
+ *  are handed to a new thread when theirs exits, so their counts never go
+ *  backwards, and a scrape sums them all.
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include "aesdsocket.h"
+
+#define CACHE_LINE 64
+#define REPLAY_BUCKETS 7    //Replay duration buckets, 100 us growing tenfold up to 100 s
+#define METRICS_BUFFER 4096
+
+struct metric_slot {
+    _Atomic uint64_t counters[METRIC_COUNT];
+    _Atomic uint64_t replay_buckets[REPLAY_BUCKETS];
+    atomic_bool in_use;
+    struct metric_slot *next;
+} __attribute__((aligned(CACHE_LINE)));
+
+static _Atomic(struct metric_slot *) slots = NULL;
+static _Thread_local struct metric_slot *thread_slot = NULL;
+static pthread_key_t slot_key;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+    double scale;   //Multiplier from the stored integer to the exposed unit
+} metric_info[METRIC_COUNT] = {
+    [METRIC_ACCEPTED] = { "aesdsocket_connections_accepted_total", "counter", "Client connections accepted.", 1 },
+    [METRIC_CLOSED] = { "aesdsocket_connections_closed_total", "counter", "Client connections closed.", 1 },
+    [METRIC_BYTES_IN] = { "aesdsocket_received_bytes_total", "counter", "Bytes received from clients.", 1 },
+    [METRIC_BYTES_OUT] = { "aesdsocket_replayed_bytes_total", "counter", "Bytes of history sent back to clients.", 1 },
+    [METRIC_PACKETS] = { "aesdsocket_packets_committed_total", "counter", "Packets appended to the data file.", 1 },
+    [METRIC_FILE_WAIT_NS] = { "aesdsocket_file_mutex_wait_seconds_total", "counter", "Time spent waiting for fileMutex.", 1e-9 },
+    [METRIC_COMMIT_WAIT_NS] = { "aesdsocket_commit_mutex_wait_seconds_total", "counter", "Time spent waiting for the group commit mutex.", 1e-9 },
+    [METRIC_TIMESTAMPS] = { "aesdsocket_timestamps_written_total", "counter", "Timestamp lines appended by the timer.", 1 },
+    [METRIC_LOG_WAIT_NS] = { "aesdsocket_log_sync_wait_seconds_total", "counter", "Time appends spent waiting for the persistent log to sync.", 1e-9 },
+};
+
+static void slotRelease(void *arg){
+    atomic_store_explicit(&((struct metric_slot *)arg)->in_use, false, memory_order_release);
+}
+
+static void slotKeyCreate(){
+    pthread_key_create(&slot_key, slotRelease);
+}
+
+//Claim a slot a finished thread left behind, or push a new one
+static struct metric_slot *slotClaim(){
+    pthread_once(&slot_once, slotKeyCreate);
+
+    struct metric_slot *slot;
+    for (slot = atomic_load_explicit(&slots, memory_order_acquire); slot != NULL; slot = slot->next) {
+        bool free_slot = false;
+        if (atomic_compare_exchange_strong_explicit(&slot->in_use, &free_slot, true, memory_order_acquire, memory_order_relaxed)) break;
+    }
+    if (slot == NULL) {
+        slot = (struct metric_slot *)aligned_alloc(CACHE_LINE, sizeof *slot);
+        if (slot == NULL) return NULL;
+        memset(slot, 0, sizeof *slot);
+        atomic_init(&slot->in_use, true);
+        slot->next = atomic_load_explicit(&slots, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&slots, &slot->next, slot, memory_order_release, memory_order_relaxed));
+    }
+    pthread_setspecific(slot_key, slot);    //Hands the slot back when this thread exits
+    thread_slot = slot;
+    return slot;
+}
+
+static struct metric_slot *slotGet(){
+    return (thread_slot != NULL) ? thread_slot : slotClaim();
+}
+
+//Only the owning thread writes a slot, so a plain add is enough and avoids a locked instruction
+static void slotAdd(_Atomic uint64_t *counter, uint64_t value){
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+void metricAdd(enum metric metric, uint64_t value){
+    if (USE_METRICS == 0) return;
+
+    struct metric_slot *slot = slotGet();
+    if (slot != NULL) slotAdd(&slot->counters[metric], value);
+}
+
+uint64_t metricNow(){
+    if (USE_METRICS == 0) return 0;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metricReplay(uint64_t started){
+    if (USE_METRICS == 0) return;
+
+    struct metric_slot *slot = slotGet();
+    if (slot == NULL) return;
+    uint64_t elapsed = metricNow() - started;
+    uint64_t bound = 100000;    //Nanoseconds in the first bucket
+    int bucket = 0;
+    while (bucket < REPLAY_BUCKETS && elapsed > bound) {
+        bound *= 10;
+        bucket++;
+    }
+    if (bucket < REPLAY_BUCKETS) slotAdd(&slot->replay_buckets[bucket], 1);
+    slotAdd(&slot->counters[METRIC_REPLAYS], 1);
+    slotAdd(&slot->counters[METRIC_REPLAY_NS], elapsed);
+}
+
+void metricLock(pthread_mutex_t *mutex, enum metric metric){
+    if (USE_METRICS == 0 || pthread_mutex_trylock(mutex) != 0) {
+        uint64_t started = metricNow();     //Only a contended lock pays for the clock reads
+        pthread_mutex_lock(mutex);
+        if (USE_METRICS == 1) metricAdd(metric, metricNow() - started);
+    }
+}
+
+static int metricsFormat(char *buf, size_t size){
+    uint64_t totals[METRIC_COUNT] = { 0 };
+    uint64_t replay_buckets[REPLAY_BUCKETS] = { 0 };
+    int len = 0;
+
+    for (struct metric_slot *slot = atomic_load_explicit(&slots, memory_order_acquire); slot != NULL; slot = slot->next) {
+        for (int i = 0; i < METRIC_COUNT; i++) totals[i] += atomic_load_explicit(&slot->counters[i], memory_order_relaxed);
+        for (int i = 0; i < REPLAY_BUCKETS; i++) replay_buckets[i] += atomic_load_explicit(&slot->replay_buckets[i], memory_order_relaxed);
+    }
+
+#define APPEND(...) do { if (len >= 0 && (size_t) len < size) len += snprintf(buf + len, size - len, __VA_ARGS__); } while (0)
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        if (metric_info[i].name == NULL) continue;
+        APPEND("# HELP %s %s\n# TYPE %s %s\n", metric_info[i].name, metric_info[i].help, metric_info[i].name, metric_info[i].type);
+        if (metric_info[i].scale == 1) APPEND("%s %llu\n", metric_info[i].name, (unsigned long long) totals[i]);
+        else APPEND("%s %.9f\n", metric_info[i].name, totals[i] * metric_info[i].scale);
+    }
+
+    //Closes are counted after accepts, so a scrape can only overstate the active connections briefly
+    uint64_t active = totals[METRIC_ACCEPTED] > totals[METRIC_CLOSED] ? totals[METRIC_ACCEPTED] - totals[METRIC_CLOSED] : 0;
+    APPEND("# HELP aesdsocket_connections_active Client connections currently open.\n# TYPE aesdsocket_connections_active gauge\n");
+    APPEND("aesdsocket_connections_active %llu\n", (unsigned long long) active);
+
+    APPEND("# HELP aesdsocket_replay_duration_seconds Time to send the history back to a client.\n");
+    APPEND("# TYPE aesdsocket_replay_duration_seconds histogram\n");
+    uint64_t cumulative = 0;
+    double bound = 0.0001;
+    for (int i = 0; i < REPLAY_BUCKETS; i++, bound *= 10) {
+        cumulative += replay_buckets[i];
+        APPEND("aesdsocket_replay_duration_seconds_bucket{le=\"%g\"} %llu\n", bound, (unsigned long long) cumulative);
+    }
+    APPEND("aesdsocket_replay_duration_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long) totals[METRIC_REPLAYS]);
+    APPEND("aesdsocket_replay_duration_seconds_sum %.9f\n", totals[METRIC_REPLAY_NS] * 1e-9);
+    APPEND("aesdsocket_replay_duration_seconds_count %llu\n", (unsigned long long) totals[METRIC_REPLAYS]);
+
+    if (USE_AESD_CHAR_DEVICE == 0) {
+        APPEND("# HELP aesdsocket_data_file_bytes Committed length of the data file.\n# TYPE aesdsocket_data_file_bytes gauge\n");
+        APPEND("aesdsocket_data_file_bytes %lld\n", (long long) fileCommitted());
+    }
+    if (USE_SEGMENTS == 1) {
+        APPEND("# HELP aesdsocket_data_file_start_bytes Oldest data file offset retention has kept.\n# TYPE aesdsocket_data_file_start_bytes gauge\n");
+        APPEND("aesdsocket_data_file_start_bytes %lld\n", (long long) segmentsStart());
+    }
+    if (USE_WORKER_POOL == 1) {
+        APPEND("# HELP aesdsocket_pool_queue_depth Accepted clients waiting for a worker.\n# TYPE aesdsocket_pool_queue_depth gauge\n");
+        APPEND("aesdsocket_pool_queue_depth %zu\n", poolDepth());
+    }
+#undef APPEND
+
+    return (len < 0 || (size_t) len < size) ? len : (int) size - 1;
+}
+
+//Answer each scrape with one HTTP response, which is also readable with plain nc
+static void *metricsRoutine(void *arg){
+    int listen_fd = (int)(intptr_t)arg;
+    char request[1024];
+    char *body = (char *)malloc(METRICS_BUFFER);
+    struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+
+    if (body == NULL) {
+        syslog(LOG_ERR, "ERROR with metrics malloc");
+        return NULL;
+    }
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno != EINTR) syslog(LOG_ERR, "ERROR with metrics accept: %s", strerror(errno));
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        if (recv(fd, request, sizeof request, 0) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            close(fd);
+            continue;
+        }
+
+        int body_len = metricsFormat(body, METRICS_BUFFER);
+        char header[128];
+        int header_len = snprintf(header, sizeof header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %d\r\n\r\n", body_len);
+        if (send(fd, header, header_len, MSG_NOSIGNAL) == header_len) send(fd, body, body_len, MSG_NOSIGNAL);
+        close(fd);
+    }
+    return NULL;
+}
+
+void metricsStart(){
+    struct sockaddr_in address;
+    pthread_t pthread;
+    int yes = 1;
+
+    if (USE_METRICS == 0) return;
+
+    memset(&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_port = htons(METRICS_PORT);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);     //Local scrapes only
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes) == -1 ||
+        bind(fd, (struct sockaddr *)&address, sizeof address) == -1 || listen(fd, 16) == -1) {
+        syslog(LOG_ERR, "ERROR with metrics socket: %s", strerror(errno));
+        if (fd != -1) close(fd);
+        return;     //The server runs on without metrics
+    }
+    if (pthread_create(&pthread, NULL, metricsRoutine, (void *)(intptr_t)fd) != 0) {
+        syslog(LOG_ERR, "ERROR with metrics pthread_create");
+        close(fd);
+        return;
+    }
+    pthread_detach(pthread);
+    syslog(LOG_INFO, "Serving metrics on 127.0.0.1:%d", METRICS_PORT);
+}
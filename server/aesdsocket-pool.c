@@ -0,0 +1,153 @@
+/*
+ * aesdsocket-pool.c
+ *
+ *  Fixed size worker pool for aesdsocket. The accept loop hands clients to
+ *  the workers through a bounded lock-free multi-producer multi-consumer
+ *  queue (one sequence number per cell, after Dmitry Vyukov's design), with
+ *  semaphores used only to park threads while the queue is empty or full.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslog.h>
+#include "aesdsocket.h"
+
+#if (POOL_QUEUE & (POOL_QUEUE - 1)) != 0
+#error "POOL_QUEUE must be a power of two"
+#endif
+
+#define CACHE_LINE 64
+
+struct pool_cell {
+    atomic_size_t sequence;     //Position this cell is ready for, enqueue when equal to it and dequeue when one past it
+    pthread_arg_t *arg;
+};
+
+static struct pool_cell cells[POOL_QUEUE];
+static _Alignas(CACHE_LINE) atomic_size_t enqueue_pos;     //Padded so producers and consumers do not share a line
+static _Alignas(CACHE_LINE) atomic_size_t dequeue_pos;
+static _Alignas(CACHE_LINE) size_t depth_high;             //Highest depth reported so far, accept loop only
+
+static sem_t items;     //Published entries waiting for a worker
+static sem_t slots;     //Free cells, taken before accepting so a full queue stops the accept loop
+static bool slot_reserved = false;     //Accept loop only
+
+static bool queuePush(pthread_arg_t *arg){
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    while (1) {
+        struct pool_cell *cell = &cells[pos & (POOL_QUEUE - 1)];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                cell->arg = arg;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0) {
+            return false;   //Queue is full
+        }
+        else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static pthread_arg_t *queuePop(){
+    size_t pos = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+    while (1) {
+        struct pool_cell *cell = &cells[pos & (POOL_QUEUE - 1)];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                pthread_arg_t *arg = cell->arg;
+                atomic_store_explicit(&cell->sequence, pos + POOL_QUEUE, memory_order_release);
+                return arg;
+            }
+        }
+        else if (diff < 0) {
+            return NULL;    //Queue is empty
+        }
+        else {
+            pos = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static void *workerRoutine(void *arg){
+    (void)arg;
+    while (1) {
+        if (sem_wait(&items) == -1) continue;   //Interrupted by a signal, keep waiting
+
+        pthread_arg_t *pthread_arg;
+        while ((pthread_arg = queuePop()) == NULL) {
+            sched_yield();      //Counted entry is still being published by another producer
+        }
+        sem_post(&slots);
+        pthread_routine(pthread_arg);
+    }
+    return NULL;
+}
+
+size_t poolDepth(){
+    size_t enqueued = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    size_t dequeued = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+void poolStart(){
+    pthread_t pthread;
+
+    for (size_t i = 0; i < POOL_QUEUE; i++) {
+        atomic_init(&cells[i].sequence, i);
+    }
+    if (sem_init(&items, 0, 0) != 0 || sem_init(&slots, 0, POOL_QUEUE) != 0) {
+        syslog(LOG_ERR, "ERROR with pool sem_init: %s", strerror(errno));
+        exit(1);
+    }
+    for (int i = 0; i < POOL_WORKERS; i++) {
+        if (pthread_create(&pthread, NULL, workerRoutine, NULL) != 0) {
+            syslog(LOG_ERR, "ERROR with worker pthread_create");
+            exit(1);
+        }
+        pthread_detach(pthread);
+    }
+    syslog(LOG_INFO, "Started %d workers with %d queue slots", POOL_WORKERS, POOL_QUEUE);
+}
+
+void poolReserve(){
+    if (POOL_SHED == 1 || slot_reserved) return;
+
+    while (sem_wait(&slots) == -1);     //Only a signal interrupts the wait
+    slot_reserved = true;
+}
+
+bool poolSubmit(pthread_arg_t *pthread_arg){
+    if (slot_reserved) {
+        slot_reserved = false;
+    }
+    else if (sem_trywait(&slots) == -1) {
+        return false;   //No free cell, caller sheds the client
+    }
+
+    if (!queuePush(pthread_arg)) {
+        sem_post(&slots);   //Slots and cells are counted together so this should not happen
+        return false;
+    }
+    sem_post(&items);
+
+    size_t depth = poolDepth();
+    if (depth > depth_high) {
+        depth_high = depth;
+        syslog(LOG_INFO, "Accept queue depth reached %zu of %d", depth, POOL_QUEUE);
+    }
+    return true;
+}
@@ -0,0 +1,439 @@
+/*
+ * aesdsocket-segment.c
+ *
+ *  Segmented data file for aesdsocket, used when USE_SEGMENTS is set. FILENAME
+ *  is then a directory of files SEGMENT_SIZE bytes long, named after their
+ *  number, and segment n holds the data file offsets from n * SEGMENT_SIZE
+ *  on, so the file an offset is in is one division away. Offsets keep
+ *  counting from the first byte ever written and writers reserve them just
+ *  as with a single file, a record crossing the end of a segment carries on
+ *  in the next one.
+ *
+ *  A background thread indexes each segment once it is full and committed,
+ *  counting its lines and keeping the offset after every
+ *  SEGMENT_INDEX_LINES th newline, so seeking to a line scans at most that
+ *  many lines. It then deletes the oldest segments while the newer ones
+ *  still hold RETAIN_BYTES, or once they are older than RETAIN_SECONDS.
+ *  Readers take a duplicate of a segment's descriptor, so a deletion never
+ *  pulls a file from under a replay.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syslog.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "aesdsocket.h"
+
+#define SEGMENT_NAME 20         //Digits in a segment file name, zero padded so names sort in offset order
+#define SEGMENT_SCAN 65536      //Bytes read at a time when counting lines
+
+struct segment {
+    int fd;
+    bool indexed;           //Full, committed and scanned, the fields below are set
+    bool ends_line;         //Its last byte is a newline
+    uint64_t first_line;    //Newlines before the segment, counted from the history start when the table was loaded
+    uint64_t lines;         //Newlines in the segment
+    off_t line_start;       //Data file offset after its first newline, -1 if it has none
+    off_t *checkpoints;     //Data file offset after every SEGMENT_INDEX_LINES th newline in the segment
+    time_t filled;          //When the index found it full, its age for RETAIN_SECONDS
+};
+
+static pthread_rwlock_t segmentLock = PTHREAD_RWLOCK_INITIALIZER;  //Only taken for writing to add or drop segments
+static struct segment *segments = NULL;     //segments[i] is segment number first + i
+static uint64_t first = 0;
+static size_t count = 0, capacity = 0;
+static off_t history_start = 0;             //Oldest offset still held, a replay from 0 starts here
+static bool starts_line = true;             //history_start is the start of a line rather than part way through one
+static uint64_t start_line = 0;             //Newlines before history_start
+static uint64_t next_line = 0;              //Newlines before the oldest segment not indexed yet
+static int dir_fd = -1;
+
+static off_t segmentBase(uint64_t number){
+    return (off_t)(number * SEGMENT_SIZE);
+}
+
+static void segmentName(char *name, size_t size, uint64_t number){
+    snprintf(name, size, "%0*llu", SEGMENT_NAME, (unsigned long long) number);
+}
+
+static int segmentFilter(const struct dirent *entry){
+    return strlen(entry->d_name) == SEGMENT_NAME && strspn(entry->d_name, "0123456789") == SEGMENT_NAME;
+}
+
+//Append a segment to the table, segmentLock held for writing
+static bool segmentAdd(int fd){
+    if (count == capacity) {
+        size_t grown = capacity ? capacity * 2 : 16;
+        struct segment *table = (struct segment *)realloc(segments, grown * sizeof *table);
+        if (table == NULL) {
+            syslog(LOG_ERR, "ERROR with segment table realloc");
+            return false;
+        }
+        segments = table;
+        capacity = grown;
+    }
+    segments[count++] = (struct segment){ .fd = fd };
+    return true;
+}
+
+//Take the oldest segment out of the table, segmentLock held for writing. Returns its descriptor to close
+static int segmentDrop(){
+    int fd = segments[0].fd;
+    free(segments[0].checkpoints);
+    memmove(segments, segments + 1, --count * sizeof *segments);
+    first++;
+    return fd;
+}
+
+static void segmentUnlink(uint64_t number){
+    char name[SEGMENT_NAME + 1];
+    segmentName(name, sizeof name, number);
+    if (unlinkat(dir_fd, name, 0) == -1) syslog(LOG_ERR, "ERROR deleting data segment %s: %s", name, strerror(errno));
+}
+
+//Create the segments up to number, segmentLock held for writing. first is already set by segmentsOpen or
+//segmentsReset when the table is empty, so a writer past the next segment creates the ones before it too
+static bool segmentCreate(uint64_t number){
+    if (number < first) return false;
+    while (first + count <= number) {
+        char name[SEGMENT_NAME + 1];
+        segmentName(name, sizeof name, first + count);
+        int fd = openat(dir_fd, name, O_CREAT | O_RDWR, 0644);
+        if (fd < 0) {
+            syslog(LOG_ERR, "ERROR creating data segment %s: %s", name, strerror(errno));
+            return false;
+        }
+        if (!segmentAdd(fd)) {
+            close(fd);
+            return false;
+        }
+    }
+    return true;
+}
+
+//Count the newlines of the oldest segment not indexed yet if it is full, returns false if there was none
+static bool segmentIndex(char *buf){
+    off_t committed = fileCommitted();
+    size_t i = 0;
+
+    pthread_rwlock_rdlock(&segmentLock);
+    while (i < count && segments[i].indexed) i++;
+    uint64_t number = first + i;
+    off_t from = history_start > segmentBase(number) ? history_start : segmentBase(number);
+    int fd = (i < count && segmentBase(number + 1) <= committed) ? dup(segments[i].fd) : -1;
+    pthread_rwlock_unlock(&segmentLock);
+    if (fd < 0) return false;
+
+    uint64_t lines = 0;
+    off_t *checkpoints = NULL, line_start = -1;
+    bool checkpointing = true, ends_line = false;
+    for (off_t pos = from; pos < segmentBase(number + 1); ) {
+        size_t chunk = (segmentBase(number + 1) - pos < SEGMENT_SCAN) ? (size_t)(segmentBase(number + 1) - pos) : SEGMENT_SCAN;
+        ssize_t bytes_read = pread(fd, buf, chunk, pos - segmentBase(number));
+        if (bytes_read == -1 && errno == EINTR) continue;
+        if (bytes_read < 1) {
+            syslog(LOG_ERR, "ERROR reading data segment %llu: %s", (unsigned long long) number,
+                   bytes_read ? strerror(errno) : "short file");
+            free(checkpoints);
+            close(fd);
+            return false;   //Tried again on the next round
+        }
+        for (char *p = buf; (p = memchr(p, '\n', buf + bytes_read - p)) != NULL; p++) {
+            if (line_start == -1) line_start = pos + (p - buf) + 1;
+            if (++lines % SEGMENT_INDEX_LINES != 0 || !checkpointing) continue;
+            off_t *grown = (off_t *)realloc(checkpoints, lines / SEGMENT_INDEX_LINES * sizeof *checkpoints);
+            if (grown == NULL) {    //Seeks into this segment scan it from its start instead
+                free(checkpoints);
+                checkpoints = NULL;
+                checkpointing = false;
+                continue;
+            }
+            checkpoints = grown;
+            checkpoints[lines / SEGMENT_INDEX_LINES - 1] = pos + (p - buf) + 1;
+        }
+        ends_line = buf[bytes_read - 1] == '\n';
+        pos += bytes_read;
+    }
+    close(fd);
+
+    pthread_rwlock_wrlock(&segmentLock);
+    if (number < first || number >= first + count || segments[number - first].indexed) {
+        pthread_rwlock_unlock(&segmentLock);    //Only a reset drops segments not indexed yet
+        free(checkpoints);
+        return false;
+    }
+    struct segment *segment = &segments[number - first];
+    segment->first_line = next_line;
+    segment->lines = lines;
+    segment->line_start = line_start;
+    segment->checkpoints = checkpoints;
+    segment->ends_line = ends_line;
+    segment->filled = time(NULL);
+    segment->indexed = true;
+    next_line += lines;
+    pthread_rwlock_unlock(&segmentLock);
+    return true;
+}
+
+//Delete the oldest segment if retention no longer needs it, the newest one always stays. Returns false if none was
+static bool segmentRetain(){
+    off_t committed = fileCommitted();
+    time_t now = time(NULL);
+    uint64_t number = 0;
+
+    pthread_rwlock_wrlock(&segmentLock);
+    bool expired = count > 1 && segments[0].indexed &&
+                   ((RETAIN_BYTES > 0 && committed - segmentBase(first + 1) >= (off_t) RETAIN_BYTES) ||
+                    (RETAIN_SECONDS > 0 && now - segments[0].filled >= RETAIN_SECONDS));
+    int fd = -1;
+    if (expired) {
+        number = first;
+        starts_line = segments[0].ends_line;
+        start_line = segments[0].first_line + segments[0].lines;
+        fd = segmentDrop();
+        history_start = segmentBase(first);
+        if (!starts_line && segments[0].indexed && segments[0].line_start != -1) {
+            history_start = segments[0].line_start;     //Replays start with a whole line
+            start_line++;
+            starts_line = true;
+        }
+    }
+    pthread_rwlock_unlock(&segmentLock);
+    if (fd < 0) return false;
+
+    close(fd);          //Replays still reading it hold their own descriptor, the blocks go once they are done
+    segmentUnlink(number);
+    return true;
+}
+
+static void *segmentRoutine(void *arg){
+    char *buf = (char *)malloc(SEGMENT_SCAN);
+    (void)arg;
+
+    if (buf == NULL) {
+        syslog(LOG_ERR, "ERROR with segment index malloc");
+        return NULL;
+    }
+    while (1) {
+        struct timespec pause = { SEGMENT_CHECK_MS / 1000, (SEGMENT_CHECK_MS % 1000) * 1000000L };
+        nanosleep(&pause, NULL);
+
+        while (segmentIndex(buf));
+        bool deleted = false;
+        while (segmentRetain()) deleted = true;
+        if (deleted) logTrim(segmentsStart());      //The log need not restore what retention has let go
+    }
+    return NULL;
+}
+
+off_t segmentsOpen(int fd){
+    struct dirent **names = NULL;
+    off_t end = 0;
+    pthread_t pthread;
+
+    dir_fd = fd;
+    int found = scandir(FILENAME, &names, segmentFilter, alphasort);
+    pthread_rwlock_wrlock(&segmentLock);
+    for (int i = 0; i < found; i++) {
+        uint64_t number = strtoull(names[i]->d_name, NULL, 10);
+        struct stat st;
+        int segment_fd = openat(dir_fd, names[i]->d_name, O_RDWR);
+        bool whole = segment_fd >= 0 && fstat(segment_fd, &st) == 0 && st.st_size <= (off_t) SEGMENT_SIZE;
+
+        //Only a run of segments with every one before the last full continues the history, keep the newest run
+        if (count > 0 && (!whole || number != first + count || end != segmentBase(number))) {
+            syslog(LOG_WARNING, "Data segment %s does not continue the ones before it, dropping those", names[i]->d_name);
+            while (count > 0) {
+                uint64_t dropped = first;
+                close(segmentDrop());
+                segmentUnlink(dropped);
+            }
+        }
+        if (!whole) {
+            syslog(LOG_WARNING, "Data segment %s is unreadable or larger than a segment, dropping it", names[i]->d_name);
+            if (segment_fd >= 0) close(segment_fd);
+            segmentUnlink(number);
+        }
+        else if (segmentAdd(segment_fd)) {
+            if (count == 1) first = number;
+            end = segmentBase(number) + st.st_size;
+        }
+        else {
+            close(segment_fd);
+        }
+        free(names[i]);
+    }
+    free(names);
+    if (count == 0) first = 0;
+    history_start = segmentBase(first);
+    starts_line = first == 0;   //What came before an older start is gone, so its first line may be partial
+    start_line = next_line = 0;
+    pthread_rwlock_unlock(&segmentLock);
+    if (found > 0) syslog(LOG_INFO, "Opened %zu data segments, offsets %lld to %lld", count, (long long) history_start, (long long) end);
+
+    if (pthread_create(&pthread, NULL, segmentRoutine, NULL) != 0) {
+        syslog(LOG_ERR, "ERROR with segment pthread_create");
+        exit(1);
+    }
+    pthread_detach(pthread);
+    return end;
+}
+
+void segmentsReset(off_t base){
+    pthread_rwlock_wrlock(&segmentLock);
+    while (count > 0) {
+        uint64_t dropped = first;
+        close(segmentDrop());
+        segmentUnlink(dropped);
+    }
+    first = (uint64_t) base / SEGMENT_SIZE;
+    history_start = base;
+    starts_line = true;
+    start_line = next_line = 0;
+    pthread_rwlock_unlock(&segmentLock);
+}
+
+void segmentsRemove(){
+    struct dirent **names = NULL;
+    char path[PATH_MAX];
+
+    int found = scandir(FILENAME, &names, segmentFilter, alphasort);
+    for (int i = 0; i < found; i++) {
+        snprintf(path, sizeof path, "%s/%s", FILENAME, names[i]->d_name);
+        if (unlink(path) == -1) syslog(LOG_ERR, "ERROR deleting data segment %s: %s", path, strerror(errno));
+        free(names[i]);
+    }
+    free(names);
+}
+
+off_t segmentsStart(){
+    pthread_rwlock_rdlock(&segmentLock);
+    off_t start = history_start;
+    pthread_rwlock_unlock(&segmentLock);
+    return start;
+}
+
+int segmentWriteFd(off_t offset, off_t *limit){
+    uint64_t number = (uint64_t) offset / SEGMENT_SIZE;
+    int fd = -1;
+
+    pthread_rwlock_rdlock(&segmentLock);
+    if (count > 0 && number >= first && number < first + count) fd = segments[number - first].fd;
+    pthread_rwlock_unlock(&segmentLock);
+    if (fd < 0) {
+        pthread_rwlock_wrlock(&segmentLock);    //First write past the newest segment
+        if (segmentCreate(number)) fd = segments[number - first].fd;
+        pthread_rwlock_unlock(&segmentLock);
+    }
+    *limit = segmentBase(number + 1);
+    return fd;
+}
+
+int segmentReadFd(off_t *offset, off_t *limit){
+    int fd = -1;
+
+    pthread_rwlock_rdlock(&segmentLock);
+    if (*offset < history_start) *offset = history_start;   //Deleted by retention, carry on from the oldest byte kept
+    uint64_t number = (uint64_t) *offset / SEGMENT_SIZE;
+    if (count > 0 && number >= first && number < first + count) fd = dup(segments[number - first].fd);
+    else errno = ENOENT;
+    pthread_rwlock_unlock(&segmentLock);
+    *limit = segmentBase(number + 1);
+    return fd;
+}
+
+//Move offset past lines newlines, reading no further than end. Returns false if end or an error comes first
+static bool segmentSkip(off_t *offset, uint64_t *lines, off_t end, char *buf){
+    while (*lines > 0 && *offset < end) {
+        off_t limit;
+        int fd = segmentReadFd(offset, &limit);
+        if (fd < 0) return false;
+        if (limit > end) limit = end;
+        while (*lines > 0 && *offset < limit) {
+            size_t chunk = (limit - *offset < SEGMENT_SCAN) ? (size_t)(limit - *offset) : SEGMENT_SCAN;
+            ssize_t bytes_read = pread(fd, buf, chunk, *offset % SEGMENT_SIZE);
+            if (bytes_read == -1 && errno == EINTR) continue;
+            if (bytes_read < 1) {
+                close(fd);
+                return false;
+            }
+            char *p = buf;
+            while (*lines > 0 && (p = memchr(p, '\n', buf + bytes_read - p)) != NULL) {
+                p++;
+                (*lines)--;
+            }
+            *offset += (*lines == 0) ? p - buf : bytes_read;
+        }
+        close(fd);
+    }
+    return *lines == 0;
+}
+
+off_t segmentSeek(uint32_t line, uint32_t line_offset){
+    off_t end = fileCommitted();
+    char *buf = (char *)malloc(SEGMENT_SCAN);
+    if (buf == NULL) {
+        syslog(LOG_ERR, "ERROR with segment seek malloc");
+        return -1;
+    }
+
+    //Find where to start counting lines: the history start, the checkpoint before the line or the unindexed segments
+    pthread_rwlock_rdlock(&segmentLock);
+    size_t indexed = 0;
+    while (indexed < count && segments[indexed].indexed) indexed++;
+    uint64_t target = start_line + line + (starts_line ? 0 : 1);   //Newlines before the line, skipping a partial first one
+    off_t offset = history_start;
+    uint64_t skip = target - start_line;
+    off_t from = history_start;
+    uint64_t from_skip = skip;
+    size_t low = 0, high = indexed;
+    while (low < high) {    //Indexed segment holding newline number target
+        size_t mid = low + (high - low) / 2;
+        if (segments[mid].first_line + segments[mid].lines < target) low = mid + 1;
+        else high = mid;
+    }
+    if (low < indexed) {
+        struct segment *segment = &segments[low];
+        uint64_t within = target - segment->first_line;
+        size_t checkpoint = within / SEGMENT_INDEX_LINES;
+        if (checkpoint > 0 && segment->checkpoints != NULL) {
+            from = segment->checkpoints[checkpoint - 1];
+            from_skip = within - checkpoint * SEGMENT_INDEX_LINES;
+        }
+        else {
+            from = segmentBase(first + low);
+            from_skip = within;
+        }
+    }
+    else if (indexed > 0) {
+        from = segmentBase(first + indexed);
+        from_skip = target - next_line;
+    }
+    if (skip > 0 && from > offset) {    //Anything before the history start is counted from there instead
+        offset = from;
+        skip = from_skip;
+    }
+    pthread_rwlock_unlock(&segmentLock);
+
+    //Then scan to the line, and to its end to check the offset falls inside it
+    off_t line_end = offset;
+    uint64_t one = 1;
+    bool found = segmentSkip(&offset, &skip, end, buf);
+    if (found) {
+        line_end = offset;
+        if (!segmentSkip(&line_end, &one, end, buf)) line_end = end;
+    }
+    free(buf);
+    if (!found || (off_t) line_offset >= line_end - offset) return -1;
+    return offset + line_offset;
+}
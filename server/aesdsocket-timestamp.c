@@ -0,0 +1,87 @@
+/*
+ * aesdsocket-timestamp.c
+ *
+ *  Timestamp writer for aesdsocket. A thread of its own waits on a timerfd
+ *  and appends a line formatted with TIMESTAMP_FORMAT every
+ *  TIMESTAMP_INTERVAL_MS through fileAppend, the same commit path client
+ *  packets take, so timestamps keep to the schedule whether or not clients
+ *  are connecting. The formatted line is cached for the second it
+ *  describes, so short intervals call strftime at most once a second.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslog.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "aesdsocket.h"
+
+#define TIMESTAMP_BUFFER 128    //Room for the formatted line
+
+//Format the line for now into a buffer that stays valid until the next call, returns its length
+static size_t timestampFormat(time_t now, const char **line){
+    static char text[TIMESTAMP_BUFFER];
+    static size_t len = 0;
+    static time_t formatted = (time_t) -1;
+    struct tm info;
+
+    if (now != formatted) {     //Only the writer thread calls this, the cache needs no lock
+        len = (localtime_r(&now, &info) != NULL) ? strftime(text, sizeof text, TIMESTAMP_FORMAT, &info) : 0;
+        formatted = now;
+    }
+    *line = text;
+    return len;
+}
+
+static void *timestampRoutine(void *arg){
+    int timer_fd = (int)(intptr_t)arg;
+    uint64_t expirations;
+
+    tmpfileOpen();
+    while (1) {
+        ssize_t bytes_read = read(timer_fd, &expirations, sizeof expirations);
+        if (bytes_read == -1 && errno == EINTR) continue;
+        if (bytes_read != (ssize_t) sizeof expirations) {
+            syslog(LOG_ERR, "ERROR with timerfd read: %s", strerror(errno));
+            return NULL;
+        }
+
+        //Running late only ever costs the missed lines, the next one still carries the current time
+        const char *line;
+        size_t len = timestampFormat(time(NULL), &line);
+        if (len == 0) {
+            syslog(LOG_ERR, "ERROR formatting timestamp");
+            continue;
+        }
+        fileAppend(line, len);
+        metricAdd(METRIC_TIMESTAMPS, 1);
+        syslog(LOG_DEBUG, "%.*s", (int) len, line);
+    }
+    return NULL;
+}
+
+void timestampStart(){
+    pthread_t pthread;
+    struct itimerspec its = {
+        .it_interval.tv_sec = TIMESTAMP_INTERVAL_MS / 1000,
+        .it_interval.tv_nsec = (TIMESTAMP_INTERVAL_MS % 1000) * 1000000L,
+    };
+
+    if (USE_TIMESTAMPS == 0) return;
+
+    its.it_value = its.it_interval;
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer_fd == -1 || timerfd_settime(timer_fd, 0, &its, NULL) == -1) {
+        syslog(LOG_ERR, "ERROR with timerfd: %s", strerror(errno));
+        exit(-1);
+    }
+    if (pthread_create(&pthread, NULL, timestampRoutine, (void *)(intptr_t)timer_fd) != 0) {
+        syslog(LOG_ERR, "ERROR with timestamp pthread_create");
+        exit(1);
+    }
+    pthread_detach(pthread);
+}
@@ -0,0 +1,491 @@
+/*
+ * aesdsocket-uring.c
+ *
+ *  io_uring client handling for aesdsocket. One thread drives a ring with a
+ *  multishot accept on the listening socket, receives into a provided buffer
+ *  ring, appends with a write linked to an fsync of the registered data file
+ *  and replays with reads from that registered file followed by sends.
+ *
+ *  The ring is set up through the kernel interface in <linux/io_uring.h>
+ *  directly, so nothing beyond a kernel with provided buffer rings (5.19 or
+ *  later) is needed to build or run it.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/syslog.h>
+#include <unistd.h>
+#include "aesdsocket.h"
+
+#if (URING_BUFFERS & (URING_BUFFERS - 1)) != 0
+#error "URING_BUFFERS must be a power of two"
+#endif
+
+#define URING_BUFFER_GROUP 0    //Provided buffer group the receives select from
+#define URING_FIXED_FILE 0      //Index of file_fd in the registered file table
+#define URING_MAX_APPENDS 256   //Appends in flight at once, well inside the data file's commit ring
+
+enum uring_op {     //Kept in the low bits of user_data, connections are at least 8 byte aligned
+    OP_ACCEPT,
+    OP_RECV,
+    OP_WRITE,
+    OP_FSYNC,
+    OP_READ,
+    OP_SEND,
+};
+#define OP_MASK 7
+
+struct uring_conn {
+    int fd;
+    recv_buffer_t rb;   //Receive buffer, reused as the replay buffer once the packet is appended
+    size_t packet_len;  //Length of the complete packet at the front of rb
+    uint16_t ticket;    //Data file reservation of the append in flight
+    off_t append_end;   //Offset the append ends at, its replay waits until the committed length reaches it
+    int pending;        //Completions still expected for the linked write and fsync, 0 once written
+    size_t len;         //Replay bytes held in rb.buf
+    size_t sent;        //Bytes of rb.buf already sent during replay
+    off_t replay_off;   //Next file offset to replay
+    off_t replay_end;   //Committed length snapshot taken after the append, -1 to replay until end of file
+    uint64_t replay_started;    //From metricNow
+    struct uring_conn *next;    //Waiting for an append slot, or in flight in reservation order
+    char client_ip[INET_ADDRSTRLEN];
+};
+
+static struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail;      //Local tail, published to sq_tail on submit
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;
+} ring;
+
+static int listen_fd;
+static int appends = 0;     //Appends reserved and not yet replaying
+static struct uring_conn *append_head = NULL, *append_tail = NULL;     //Waiting for one of URING_MAX_APPENDS
+static struct uring_conn *inflight_head = NULL, *inflight_tail = NULL; //Reserved, oldest reservation first
+
+static int ringEnter(unsigned to_submit, unsigned min_complete){
+    return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+                   min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+//Hand every queued SQE to the kernel, optionally waiting for a completion
+static int ringSubmit(unsigned wait){
+    __atomic_store_n(ring.sq_tail, ring.sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    return ringEnter(to_submit, wait);
+}
+
+//Wait until count SQEs are free, submitting the queued ones if needed, returns false if io_uring_enter fails
+static bool ringReserve(unsigned count){
+    while (ring.sq_entries - (ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE)) < count) {
+        if (ringSubmit(0) == -1 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            syslog(LOG_ERR, "ERROR with io_uring_enter: %s", strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+static struct io_uring_sqe *ringSqe(){
+    if (!ringReserve(1)) return NULL;
+    unsigned index = ring.sqe_tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    ring.sq_array[index] = index;
+    ring.sqe_tail++;
+    return sqe;
+}
+
+static void ringSetup(){
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof params);
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 4;     //Room for every connection's completion between two waits
+    ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring.fd == -1) {
+        syslog(LOG_ERR, "ERROR with io_uring_setup: %s", strerror(errno));
+        exit(1);
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        syslog(LOG_ERR, "ERROR io_uring is too old, needs IORING_FEAT_SINGLE_MMAP");
+        exit(1);
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+    char *rings = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        syslog(LOG_ERR, "ERROR with io_uring mmap: %s", strerror(errno));
+        exit(1);
+    }
+    ring.sq_head = (unsigned *)(rings + params.sq_off.head);
+    ring.sq_tail = (unsigned *)(rings + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)(rings + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(rings + params.sq_off.array);
+    ring.sq_entries = params.sq_entries;
+    ring.sqe_tail = *ring.sq_tail;
+    ring.cq_head = (unsigned *)(rings + params.cq_off.head);
+    ring.cq_tail = (unsigned *)(rings + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)(rings + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+    //Register the data file so appends and replays skip the per request file lookup
+    int files[1] = { file_fd };
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, files, 1) == -1) {
+        syslog(LOG_ERR, "ERROR registering data file with io_uring: %s", strerror(errno));
+        exit(1);
+    }
+
+    //Provided buffer ring, the kernel picks a free buffer as each receive completes
+    ring.buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring.buffers = malloc((size_t) URING_BUFFERS * BUFFER);
+    if (ring.buf_ring == MAP_FAILED || ring.buffers == NULL) {
+        syslog(LOG_ERR, "ERROR allocating io_uring buffers");
+        exit(1);
+    }
+    struct io_uring_buf_reg reg = { .ring_addr = (uintptr_t) ring.buf_ring, .ring_entries = URING_BUFFERS,
+                                    .bgid = URING_BUFFER_GROUP };
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        syslog(LOG_ERR, "ERROR registering io_uring buffer ring: %s", strerror(errno));
+        exit(1);
+    }
+    for (unsigned i = 0; i < URING_BUFFERS; i++) {
+        struct io_uring_buf *buf = &ring.buf_ring->bufs[i];
+        buf->addr = (uintptr_t)(ring.buffers + (size_t) i * BUFFER);
+        buf->len = BUFFER;
+        buf->bid = i;
+    }
+    __atomic_store_n(&ring.buf_ring->tail, URING_BUFFERS, __ATOMIC_RELEASE);
+}
+
+static void bufferRecycle(unsigned bid){
+    uint16_t tail = ring.buf_ring->tail;
+    struct io_uring_buf *buf = &ring.buf_ring->bufs[tail & (URING_BUFFERS - 1)];
+    buf->addr = (uintptr_t)(ring.buffers + (size_t) bid * BUFFER);
+    buf->len = BUFFER;
+    buf->bid = bid;
+    __atomic_store_n(&ring.buf_ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+
+static void armAccept(){
+    struct io_uring_sqe *sqe = ringSqe();
+    if (sqe == NULL) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;     //One request keeps accepting until it is cancelled
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+}
+
+static void connClose(struct uring_conn *c){
+    close(c->fd);
+    metricAdd(METRIC_CLOSED, 1);
+    syslog(LOG_DEBUG, "Closed connection from %s", c->client_ip);
+    free(c->rb.buf);
+    free(c);
+}
+
+static void armRecv(struct uring_conn *c){
+    struct io_uring_sqe *sqe = ringSqe();
+    if (sqe == NULL) {
+        connClose(c);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->len = BUFFER;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uintptr_t) c | OP_RECV;
+}
+
+//Read the next replay chunk from the registered data file, or finish the connection
+static void replayNext(struct uring_conn *c){
+    size_t want = c->rb.cap;
+    if (c->replay_end >= 0) {
+        if (c->replay_off >= c->replay_end) {
+            metricReplay(c->replay_started);
+            connClose(c);
+            return;
+        }
+        if ((off_t) want > c->replay_end - c->replay_off) want = c->replay_end - c->replay_off;
+    }
+
+    struct io_uring_sqe *sqe = ringSqe();
+    if (sqe == NULL) {
+        connClose(c);
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = URING_FIXED_FILE;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t) c->rb.buf;
+    sqe->len = want;
+    sqe->off = c->replay_off;
+    sqe->user_data = (uintptr_t) c | OP_READ;
+}
+
+static void sendNext(struct uring_conn *c){
+    struct io_uring_sqe *sqe = ringSqe();
+    if (sqe == NULL) {
+        connClose(c);
+        return;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t)(c->rb.buf + c->sent);
+    sqe->len = c->len - c->sent;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uintptr_t) c | OP_SEND;
+}
+
+//Replay from replay_off, after the first header_len bytes of rb.buf if a resume header is waiting there
+static void replayStart(struct uring_conn *c, off_t replay_off, off_t replay_end, size_t header_len){
+    c->replay_off = replay_off;
+    c->replay_end = replay_end;
+    c->replay_started = metricNow();
+    c->rb.len = 0;
+    packetReserve(&c->rb, URING_REPLAY_CHUNK);   //Read the history in larger chunks, a failure just keeps the smaller buffer
+    c->len = header_len;
+    c->sent = 0;
+    if (header_len > 0) sendNext(c);
+    else replayNext(c);
+}
+
+//Write the packet at a reserved offset, linked to an fsync so the replay only starts once it is durable
+static void appendStart(struct uring_conn *c){
+    c->pending = (URING_FSYNC == 1) ? 2 : 1;
+    appends++;
+
+    off_t offset;
+    if (USE_PERSISTENT_LOG == 1) {      //Never waits for the log sync, the ring thread can't block and aesdsocket.h rejects LOG_SYNC_MS=0
+        struct iovec iov = { .iov_base = c->rb.buf, .iov_len = c->packet_len };
+        logAppend(&iov, 1, c->packet_len, &c->ticket, &offset);
+    }
+    else offset = fileReserve(c->packet_len, &c->ticket);
+    c->append_end = offset + (off_t) c->packet_len;
+    c->next = NULL;
+    if (inflight_tail != NULL) inflight_tail->next = c;
+    else inflight_head = c;
+    inflight_tail = c;
+
+    //Both SQEs go in together, a submit between them would send the linked write off without its fsync
+    struct io_uring_sqe *sqe = ringReserve(c->pending) ? ringSqe() : NULL;
+    if (sqe == NULL) {
+        c->pending = 0;     //Never leave a reservation unpublished, the client is dropped once it retires
+        close(c->fd);
+        c->fd = -1;
+        filePublish(c->ticket, c->packet_len);
+        return;
+    }
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = URING_FIXED_FILE;
+    sqe->flags = IOSQE_FIXED_FILE | ((URING_FSYNC == 1) ? IOSQE_IO_LINK : 0);
+    sqe->addr = (uintptr_t) c->rb.buf;
+    sqe->len = c->packet_len;
+    sqe->off = offset;
+    sqe->user_data = (uintptr_t) c | OP_WRITE;
+
+    if (URING_FSYNC == 1) {
+        sqe = ringSqe();    //Cannot fail, ringReserve made room for both
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = URING_FIXED_FILE;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = (uintptr_t) c | OP_FSYNC;
+    }
+}
+
+static void packetComplete(struct uring_conn *c){
+    c->rb.buf[c->packet_len] = '\0';
+
+    //Commands do not append and the device has no offsets to reserve, both stay synchronous
+    if (USE_AESD_CHAR_DEVICE == 1 || strncmp(c->rb.buf, "AESDCHAR_IOCSEEKTO:", 19) == 0 ||
+        strncmp(c->rb.buf, "AESDSOCKET_RESUME:", 18) == 0) {
+        off_t replay_end;
+        size_t header_len;
+        off_t replay_off = packetAppend(c->rb.buf, c->packet_len, &replay_end, &header_len);
+        replayStart(c, replay_off, replay_end, header_len);
+        return;
+    }
+
+    if (appends >= URING_MAX_APPENDS) {     //Wait for a slot rather than run the data file's commit ring dry
+        c->next = NULL;
+        if (append_tail != NULL) append_tail->next = c;
+        else append_head = c;
+        append_tail = c;
+        return;
+    }
+    appendStart(c);
+}
+
+//Replay every append the committed length now covers, they retire in reservation order since appends finish in any order
+static void appendRetire(){
+    while (inflight_head != NULL && inflight_head->pending == 0 && inflight_head->append_end <= fileCommitted()) {
+        struct uring_conn *c = inflight_head;
+        inflight_head = c->next;
+        if (inflight_head == NULL) inflight_tail = NULL;
+        appends--;
+        if (c->fd == -1) {
+            free(c->rb.buf);
+            free(c);
+        }
+        else {
+            metricAdd(METRIC_PACKETS, 1);
+            replayStart(c, 0, fileCommitted(), 0);
+        }
+    }
+
+    while (append_head != NULL && appends < URING_MAX_APPENDS) {
+        struct uring_conn *waiting = append_head;
+        append_head = waiting->next;
+        if (append_head == NULL) append_tail = NULL;
+        appendStart(waiting);
+    }
+}
+
+static void connAccepted(int fd){
+    struct sockaddr_in client_address;
+    socklen_t client_address_len = sizeof client_address;
+
+    struct uring_conn *c = (struct uring_conn *)calloc(1, sizeof *c);
+    if (c == NULL || !packetReserve(&c->rb, BUFFER)) {
+        syslog(LOG_ERR, "ERROR with connection malloc");
+        if (c != NULL) free(c->rb.buf);
+        free(c);
+        close(fd);
+        return;
+    }
+    metricAdd(METRIC_ACCEPTED, 1);
+    c->fd = fd;
+    if (getpeername(fd, (struct sockaddr *)&client_address, &client_address_len) == 0) {
+        inet_ntop(AF_INET, &(client_address.sin_addr), c->client_ip, INET_ADDRSTRLEN);
+    }
+    syslog(LOG_DEBUG, "Accepted connection from %s", c->client_ip);
+    armRecv(c);
+}
+
+static void completionHandle(struct io_uring_cqe *cqe){
+    struct uring_conn *c = (struct uring_conn *)(uintptr_t)(cqe->user_data & ~(uint64_t) OP_MASK);
+    int res = cqe->res;
+
+    switch (cqe->user_data & OP_MASK) {
+    case OP_ACCEPT:
+        if (res >= 0) connAccepted(res);
+        else if (res != -EINTR) syslog(LOG_ERR, "ERROR with accept: %s", strerror(-res));
+        if (!(cqe->flags & IORING_CQE_F_MORE)) armAccept();     //The kernel dropped the multishot accept, rearm it
+        break;
+
+    case OP_RECV:
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            bool kept = res < 1 || packetReserve(&c->rb, res);
+            if (res > 0 && kept) {
+                memcpy(c->rb.buf + c->rb.len, ring.buffers + (size_t) bid * BUFFER, res);
+                c->rb.len += res;
+                metricAdd(METRIC_BYTES_IN, res);
+            }
+            bufferRecycle(bid);
+            if (!kept) {
+                connClose(c);   //The packet outgrew MAX_PACKET or memory, the chunk cannot be dropped from the middle of it
+                break;
+            }
+        }
+        if (res == -ENOBUFS) {     //Every provided buffer was in use, try again
+            armRecv(c);
+            break;
+        }
+        if (res < 1) {
+            connClose(c);   //Client hung up or errored before completing a packet
+            break;
+        }
+        c->packet_len = packetScan(&c->rb);
+        if (c->packet_len > 0) packetComplete(c);
+        else armRecv(c);
+        break;
+
+    case OP_WRITE:
+    case OP_FSYNC:
+        if (res < 0 && res != -ECANCELED) syslog(LOG_ERR, "ERROR with append: %s", strerror(-res));
+        else if ((cqe->user_data & OP_MASK) == OP_WRITE && (size_t) res < c->packet_len) syslog(LOG_ERR, "ERROR short append");
+        if (--c->pending == 0) {
+            filePublish(c->ticket, c->packet_len);
+            appendRetire();
+        }
+        break;
+
+    case OP_READ:
+        if (res < 0) syslog(LOG_ERR, "ERROR with replay read: %s", strerror(-res));
+        if (res == 0) metricReplay(c->replay_started);     //Char device replays end at end of file
+        if (res < 1) {
+            connClose(c);
+            break;
+        }
+        c->replay_off += res;
+        c->len = res;
+        c->sent = 0;
+        sendNext(c);
+        break;
+
+    case OP_SEND:
+        if (res < 0) {
+            if (res != -EPIPE && res != -ECONNRESET) syslog(LOG_ERR, "ERROR with send: %s", strerror(-res));
+            connClose(c);
+            break;
+        }
+        c->sent += res;
+        metricAdd(METRIC_BYTES_OUT, res);
+        if (c->sent < c->len) sendNext(c);
+        else replayNext(c);
+        break;
+    }
+}
+
+void uringServe(int sock_fd){
+    struct rlimit limit;
+
+    listen_fd = sock_fd;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1) syslog(LOG_ERR, "ERROR with setrlimit: %s", strerror(errno));
+    }
+
+    tmpfileOpen();
+    ringSetup();
+    armAccept();
+
+    while (1) {
+        if (ringSubmit(1) == -1 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            syslog(LOG_ERR, "ERROR with io_uring_enter: %s", strerror(errno));
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            completionHandle(&ring.cqes[head & *ring.cq_mask]);
+            head++;
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);     //Free the slot before the next one is handled
+        }
+    }
+}
@@ -9,28 +9,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/syslog.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdbool.h>
-#include "aesd_ioctl.h"
-
-//
-//
-//Settings
-//
-//
-#define PORT 9000
-#define BACKLOG 10
-#define FALSE 0
-#define TRUE 1
-#define TIMER 10    //Defines the wait time in seconds
-#define USE_AESD_CHAR_DEVICE 1
-#define BUFFER 1024
-
-const char* FILENAME = (USE_AESD_CHAR_DEVICE == 1) ? "/dev/aesdchar" : "/var/tmp/aesdsocketdata";
+#include "aesdsocket.h"
 
 //
 //
@@ -38,61 +22,42 @@ const char* FILENAME = (USE_AESD_CHAR_DEVICE == 1) ? "/dev/aesdchar" : "/var/tmp
 //
 //
 
-int socket_fd = -1; //Declare the global variables for socket and file fds
-int file_fd = -1;
-pthread_mutex_t fileMutex; //Declare the mutex lock
-atomic_bool timeStamp = FALSE;
-
-typedef struct pthread_arg_t {      //Struct definition for multithreading
-    int new_socket_fd;
-    struct sockaddr_in client_address;      //Struct to save the client address
-    bool completed;
-} pthread_arg_t;
+int socket_fd = -1; //Declare the global variable for the socket fd
 
 //
 //
-//Function declarations
+//Signal Handler function
 //
 //
 
-// Thread routine to serve connection to client
-void *pthread_routine(void *arg);
+//Termination signals are blocked in every thread and taken here with sigwait, so the cleanup runs as ordinary
+//code. A handler would interrupt whatever thread the signal landed on, maybe inside malloc or holding a lock.
+static void *signalRoutine(void *arg) {
+    sigset_t *set = (sigset_t *)arg;
+    int sig;
 
-//Timer setup function
-static void timerSetup();
-
-//Temporary file open
-static void tmpfileOpen();
-
-//File writing function
-void fileWrite(char* textbuffer);
-
-//
-//
-//Signal Handler function
-//
-//
-void signal_handler(int sig, siginfo_t *si, void *uc) {
-    (void)uc;   //Type cast uc to void as we dont need it
+    while (sigwait(set, &sig) != 0);
 
-    if(si->si_code == SI_TIMER){
-        timeStamp = TRUE;   //Set the global flag for the timer to true to be signal safe
+    if (USE_GROUP_COMMIT == 1){
+        char stats[1024];
+        groupCommitStats(stats, sizeof stats);
+        syslog(LOG_INFO, "%s", stats);  //Report how well packets were batched before going away
+    }
 
-    } else{  //Can reasonably assume any other code is an issue
+    logClose();     //The restart restores from the log whatever happens to the data file below
 
-        if (USE_AESD_CHAR_DEVICE == 0){
-            if (file_fd >= 0 && close(file_fd)) syslog(LOG_ERR, "%s: %m", "Close file"); //If a file is still open, close it and log it
-        }
-        if (socket_fd >= 0 && close(socket_fd)) syslog(LOG_ERR, "%s: %m", "Close server descriptor");   //Close the socket descritor and error if unable
-        if ((unlink(FILENAME)) == -1 ) syslog(LOG_ERR, "%s: %m", "Error deleting tmp file");   //Delete the tmp file we created and log if error
-    
-        if((sig == SIGINT) | (sig ==SIGTERM)){
-            syslog(LOG_DEBUG,"%s", "Caught signal, exiting"); 
-            exit(EXIT_SUCCESS);
-        }
+    if (USE_AESD_CHAR_DEVICE == 0){
+        if (file_fd >= 0 && close(file_fd)) syslog(LOG_ERR, "%s: %m", "Close file"); //If a file is still open, close it and log it
+    }
+    if (socket_fd >= 0 && close(socket_fd)) syslog(LOG_ERR, "%s: %m", "Close server descriptor");   //Close the socket descritor and error if unable
+    fileRemove();   //Delete the tmp file we created and log if error
 
-        exit(EXIT_FAILURE);
+    if((sig == SIGINT) | (sig ==SIGTERM)){
+        syslog(LOG_DEBUG,"%s", "Caught signal, exiting"); 
+        exit(EXIT_SUCCESS);
     }
+
+    exit(EXIT_FAILURE);
 }
 
 //
@@ -110,9 +75,7 @@ int main(int argc, char *argv[]) {
     socklen_t client_address_len;
     static int yes = 1;
 
-    struct sigaction sa = { 0 };
-    sa.sa_flags = SA_SIGINFO;
-    sa.sa_sigaction = signal_handler;
+    static sigset_t signal_set;
 
     /* Initialise IPv4 address. */
     memset(&address, 0, sizeof address);
@@ -153,9 +116,6 @@ int main(int argc, char *argv[]) {
         syslog(LOG_ERR, "ERROR with setting pthread state");
         exit(1);
     }
-    if(pthread_mutex_init(&fileMutex, NULL) != 0){     //pThread mutex initialization
-        syslog(LOG_ERR, "ERROR mutex init fail");
-    }
 
     if (argc > 1){  //Argument check and daemon mode
         if (strcmp(argv[1], "-d") == 0){
@@ -178,44 +138,35 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if (USE_AESD_CHAR_DEVICE == 0) {
-        timerSetup();
-    }
-
-    // Assign signal handlers to signals
-    if (sigaction(SIGTERM, &sa, NULL) == -1) {
-        syslog(LOG_ERR, "ERROR with signal: %s", strerror(errno));
+    // Block the termination signals before any thread starts, so they all inherit the mask and only signalRoutine takes them
+    sigemptyset(&signal_set);
+    sigaddset(&signal_set, SIGTERM);
+    sigaddset(&signal_set, SIGINT);
+    if (pthread_sigmask(SIG_BLOCK, &signal_set, NULL) != 0) {
+        syslog(LOG_ERR, "ERROR with signal mask");
         exit(1);
     }
-    if (sigaction(SIGINT, &sa, NULL) == -1) {
-        syslog(LOG_ERR, "ERROR signal: %s", strerror(errno));
+    if (pthread_create(&pthread, NULL, signalRoutine, &signal_set) != 0) {
+        syslog(LOG_ERR, "ERROR with signal pthread_create");
         exit(1);
     }
-    if (sigaction(SIGRTMIN, &sa, NULL) == -1){
-        syslog(LOG_ERR, "ERROR sigaction: %s", strerror(errno));
-        exit(-1);
-    }
+    pthread_detach(pthread);
 
+    logOpen();      //After the fork, its sync thread has to run in the daemon
+    timestampStart();   //Restored history first, so timestamps follow it
+    metricsStart();
 
-    while (1) {
-
-        if(timeStamp == TRUE){
-            time_t rawtime;
-            struct tm *info;
-            char *textbuffer = (char*)calloc(31, sizeof(char)); //Dynamically allocate the array accordingly 
-
-            time(&rawtime);
-            info = localtime(&rawtime);
-            strftime(textbuffer,31,"timestamp:%F %H:%M:%S\n", info);
-
-            pthread_mutex_lock(&fileMutex);    //Obtain mutex lock
-            fileWrite(textbuffer);      //Send the textbuffer to the file writing function
-            pthread_mutex_unlock(&fileMutex);    //Obtain mutex lock
-            syslog(LOG_DEBUG, "%s", textbuffer);
+    if (USE_EPOLL == 1) {
+        epollServe(socket_fd);  //Reactor threads take over the listening socket and never return
+    }
+    if (USE_IO_URING == 1) {
+        uringServe(socket_fd);  //The ring thread takes over the listening socket and never returns
+    }
+    if (USE_WORKER_POOL == 1) {
+        poolStart();
+    }
 
-            free(textbuffer);                   //Free the textbuffer created
-            timeStamp = FALSE;
-        }
+    while (1) {
 
         // Create pthread argument for each connection to client
         pthread_arg = (pthread_arg_t *)malloc(sizeof *pthread_arg); //Dynamically allocate the memory needed for a new client connection
@@ -224,6 +175,10 @@ int main(int argc, char *argv[]) {
             continue;
         }
 
+        if (USE_WORKER_POOL == 1) {
+            poolReserve();      //Stop accepting while every queue slot is taken, the kernel backlog holds new clients
+        }
+
         // Accept connection to client
         client_address_len = sizeof pthread_arg->client_address;
         new_socket_fd = accept(socket_fd, (struct sockaddr *)&pthread_arg->client_address, &client_address_len);
@@ -235,10 +190,25 @@ int main(int argc, char *argv[]) {
 
         // Initialise pthread argument
         pthread_arg->new_socket_fd = new_socket_fd;
+        metricAdd(METRIC_ACCEPTED, 1);
+
+        if (USE_WORKER_POOL == 1) {
+            if (!poolSubmit(pthread_arg)) {
+                char client_ip[INET_ADDRSTRLEN];
+                inet_ntop(AF_INET, &(pthread_arg->client_address.sin_addr), client_ip, INET_ADDRSTRLEN);
+                syslog(LOG_WARNING, "Shedding connection from %s, accept queue full at depth %zu", client_ip, poolDepth());
+                close(new_socket_fd);
+                metricAdd(METRIC_CLOSED, 1);
+                free(pthread_arg);
+            }
+            continue;
+        }
 
         // Create thread to serve connection to client
         if (pthread_create(&pthread, &pthread_attr, pthread_routine, (void *)pthread_arg) != 0) {
             syslog(LOG_ERR,"ERROR with pthread_create");
+            close(new_socket_fd);
+            metricAdd(METRIC_CLOSED, 1);
             free(pthread_arg);
             continue;
         }
@@ -260,120 +230,77 @@ void *pthread_routine(void *arg) {
 
     tmpfileOpen();
 
-    //unsigned long totalbytes = 0;
-    bool cmd = false;
-
-    // Read data from the client connection
-    while (1) {
-        char *textbuffer = (char*)calloc(BUFFER, sizeof(char));
-        ssize_t bytes_read = recv(new_socket_fd, textbuffer, BUFFER, 0);
-        
-        if (bytes_read < 1){
-            free(textbuffer);
-            return NULL;
-        }
-        //totalbytes += bytes_read;
-
-        pthread_mutex_lock(&fileMutex); //Lock the file for writing
-
-        if (strchr(textbuffer, '\n') != NULL) {
-            // check if ioctl command in stream
-            if (strncmp(textbuffer, "AESDCHAR_IOCSEEKTO:", strnlen(textbuffer, sizeof(textbuffer))) == 0){
-                struct aesd_seekto seekto;
-                char *cmdToken = strtok(textbuffer+19, ",");
-                seekto.write_cmd = atoi(cmdToken);
-                printf("First command set to %d\n", seekto.write_cmd);
-                cmdToken=strtok(NULL, ",");
-                seekto.write_cmd_offset = atoi(cmdToken);
-                printf("Seccond command set to %d\n", seekto.write_cmd_offset);
-                ioctl(file_fd, AESDCHAR_IOCSEEKTO, (unsigned long)&seekto);
-                cmd = true;
-            } 
-            else {
-                write(file_fd, textbuffer, bytes_read);
-            }
-
-            free(textbuffer);
-            pthread_mutex_unlock(&fileMutex);
-            break;
-        } 
-        else {
-            write(file_fd, textbuffer, bytes_read);
-            free(textbuffer);
-            pthread_mutex_unlock(&fileMutex);
-        }
-        free(textbuffer);
-        pthread_mutex_unlock(&fileMutex);   //Release the mutex
+    off_t replay_start = 0;
+    off_t replay_end = -1;
+    recv_buffer_t rb = { 0 };  //One buffer for the whole connection, grown only if the packet outgrows it
 
-    }
-
-    pthread_mutex_lock(&fileMutex); //Relock the file for reading
-
-    // If we didnt get a seek command
-    if(cmd == false){ 
-        if (lseek(file_fd, (off_t) 0, SEEK_SET) == (off_t) -1){ //Check for error with (off_t) as defined by POSIX
-            syslog(LOG_ERR, "ERROR with seek");
-            raise(SIGINT);
-        }
-    }
-    char *textbuff = (char*) calloc(BUFFER, sizeof(char));
-    if (textbuff == NULL){ 
+    // Read data from the client connection until a whole packet is in the buffer
+    ssize_t packet_len = packetReceive(new_socket_fd, &rb);
+    if (packet_len < 1){
+        free(rb.buf);
+        close(new_socket_fd);   //Client went away, release the descriptor so pooled workers do not leak it
+        metricAdd(METRIC_CLOSED, 1);
         return NULL;
     }
-    ssize_t bytes_read = 0;
-    ssize_t bytes_send = 0;
-    while ((bytes_read = read(file_fd, textbuff, BUFFER)) > 0){    //Bytes and buffer set to 1024, 1kB
-        while ((bytes_send = send(new_socket_fd, textbuff, bytes_read, 0)) < bytes_read){
-            syslog(LOG_ERR, "ERROR with send");
-            raise(SIGINT);
-        }
+    rb.buf[packet_len] = '\0';     //Terminate for packetAppend, which parses commands as strings
+    size_t header_len;
+    replay_start = packetAppend(rb.buf, packet_len, &replay_end, &header_len);  //One write per packet, so clients cannot interleave
+    if (header_len > 0 && send(new_socket_fd, rb.buf, header_len, MSG_NOSIGNAL) != (ssize_t) header_len){
+        syslog(LOG_ERR, "ERROR with send: %s", strerror(errno));
     }
-    pthread_mutex_unlock(&fileMutex);    //Unlock the mutex from the read lock we did
-    free(textbuff);
+    free(rb.buf);
+
+    uint64_t replay_started = metricNow();
+    fileReplay(new_socket_fd, replay_start, replay_end);
+    metricReplay(replay_started);
     close(new_socket_fd);
+    metricAdd(METRIC_CLOSED, 1);
     syslog(LOG_DEBUG, "Closed connection from %s", client_ip);
     return NULL;
 }
 
-void fileWrite(char* textbuffer){
-    if ((write(file_fd, textbuffer, strlen(textbuffer))) == -1){
-        syslog(LOG_ERR, "ERROR with write");
+bool packetReserve(recv_buffer_t *rb, size_t room){
+    if (rb->len + room > MAX_PACKET) {     //A client that never sends its newline must not grow this without end
+        syslog(LOG_ERR, "ERROR packet longer than %lu bytes, closing the connection", (unsigned long) MAX_PACKET);
+        return false;
+    }
+    size_t cap = (rb->cap == 0) ? BUFFER : rb->cap;
+    while (cap - rb->len < room + 1) cap *= 2;     //Always keep a spare byte so the packet can be null terminated
+    if (cap == rb->cap) return true;
+
+    char *grown = (char *)realloc(rb->buf, cap);
+    if (grown == NULL) {
+        syslog(LOG_ERR, "ERROR with receive buffer realloc");
+        return false;
     }
+    rb->buf = grown;
+    rb->cap = cap;
+    return true;
 }
 
-static void timerSetup(){  //Everything needed to setup the reoccuring 10s timer
-    timer_t timerId = 0;
-
-    struct sigevent sev = { 0 };
-    struct itimerspec its = {   .it_interval.tv_sec  = TIMER,  //Specifies the time in seconds to wait resetting automatically
-                                .it_interval.tv_nsec = 0,
-                                .it_value.tv_sec  = 1,      //If set to 0 timer is disarmed
-                                .it_value.tv_nsec = 0
-                            };
-    
-    sev.sigev_notify = SIGEV_SIGNAL; // Linux-specific
-    sev.sigev_signo = SIGRTMIN;
-
-    //Create the Timer
-    if (timer_create(CLOCK_REALTIME, &sev, &timerId) != 0){
-        syslog(LOG_ERR,"Error timer_create: %s\n", strerror(errno));
-        exit(-1);
-    }
-        
-    // start timer
-    if (timer_settime(timerId, 0, &its, NULL) != 0){
-        syslog(LOG_ERR,"Error timer_settime: %s\n", strerror(errno));
-        exit(-1);
+ssize_t packetScan(recv_buffer_t *rb){
+    if (rb->len > rb->scanned) {
+        char *newline = memchr(rb->buf + rb->scanned, '\n', rb->len - rb->scanned);   //Embedded NULs do not stop memchr
+        if (newline != NULL) return newline - rb->buf + 1;
+        rb->scanned = rb->len;  //Never look at these bytes again
     }
-    free(timerId);
+    return 0;
 }
 
-static void tmpfileOpen(){
-    if (file_fd < 0) {
-        file_fd = open(FILENAME, O_CREAT | O_RDWR | O_APPEND, 0644);
-        if (file_fd < 0) {
-            syslog(LOG_ERR, "ERROR with file open");
-            raise(SIGINT);
+ssize_t packetReceive(int fd, recv_buffer_t *rb){
+    while (1) {
+        ssize_t packet_len = packetScan(rb);
+        if (packet_len > 0) return packet_len;
+        if (!packetReserve(rb, 1)) return -1;
+
+        ssize_t bytes_read = recv(fd, rb->buf + rb->len, rb->cap - rb->len - 1, 0);
+        if (bytes_read > 0) {
+            rb->len += bytes_read;
+            metricAdd(METRIC_BYTES_IN, bytes_read);
+            continue;
         }
+        if (bytes_read == -1 && errno == EINTR) continue;
+        if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        return -1;      //Client hung up or errored before completing a packet
     }
 }
@@ -0,0 +1,335 @@
+/*
+ * aesdsocket.h
+ *
+ *  Shared settings and declarations for the aesdsocket server sources
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+//
+//
+//Settings
+//
+//
+#define PORT 9000
+#define BACKLOG SOMAXCONN   //Listen backlog, large enough that connection bursts are not dropped by the kernel
+#define FALSE 0
+#define TRUE 1
+#ifndef USE_AESD_CHAR_DEVICE
+#define USE_AESD_CHAR_DEVICE 1
+#endif
+#define BUFFER 1024
+#define REPLAY_CHUNK 65536  //Bytes moved per splice call when replaying the char device
+#define RESUME_HEADER 64    //Room for the AESDSOCKET_END:<offset>,<epoch> line answering a resume command
+#ifndef MAX_PACKET
+#define MAX_PACKET (1UL << 20)  //Longest packet a client may send, one still without its newline past this is dropped
+#endif
+
+#ifndef USE_EPOLL
+#define USE_EPOLL 0         //Set to 1 to serve clients from epoll reactor threads instead of a thread per connection
+#endif
+#ifndef EPOLL_THREADS
+#define EPOLL_THREADS 1     //Number of reactor threads used when USE_EPOLL is set
+#endif
+#define EPOLL_EVENTS 64     //Maximum events handled per epoll_wait call
+
+#ifndef USE_WORKER_POOL
+#define USE_WORKER_POOL 0   //Set to 1 to hand accepted clients to a fixed pool of worker threads
+#endif
+#ifndef POOL_WORKERS
+#define POOL_WORKERS 8      //Number of worker threads when USE_WORKER_POOL is set
+#endif
+#ifndef POOL_QUEUE
+#define POOL_QUEUE 64       //Accept queue slots between the accept loop and the workers, must be a power of two
+#endif
+#ifndef POOL_SHED
+#define POOL_SHED 0         //When the queue is full, 0 stops accepting and 1 closes new clients with a logged reason
+#endif
+
+#ifndef USE_GROUP_COMMIT
+#define USE_GROUP_COMMIT 0  //Set to 1 to append every packet through a single batching writer thread, threaded modes only
+#endif
+#ifndef GROUP_COMMIT_BATCH
+#define GROUP_COMMIT_BATCH 64           //Most packets flushed by one vectored write
+#endif
+#ifndef GROUP_COMMIT_LATENCY_US
+#define GROUP_COMMIT_LATENCY_US 200     //Longest the writer waits for a batch to fill once a packet is queued
+#endif
+#ifndef USE_IO_URING
+#define USE_IO_URING 0      //Set to 1 to serve clients from a single io_uring thread, needs Linux 5.19 or later
+#endif
+#ifndef URING_ENTRIES
+#define URING_ENTRIES 256   //Submission queue entries, the completion queue gets four times as many
+#endif
+#ifndef URING_BUFFERS
+#define URING_BUFFERS 256   //Provided receive buffers of BUFFER bytes, a power of two
+#endif
+#ifndef URING_REPLAY_CHUNK
+#define URING_REPLAY_CHUNK 16384    //Bytes read per replay request, each replaying client holds a buffer this size
+#endif
+#ifndef URING_FSYNC
+#define URING_FSYNC 1       //Set to 0 to replay io_uring appends without waiting for the linked fdatasync
+#endif
+#ifndef USE_TIMESTAMPS
+#define USE_TIMESTAMPS (USE_AESD_CHAR_DEVICE == 0)  //Append a timestamp line on a timer, off for the char device by default
+#endif
+#ifndef TIMESTAMP_INTERVAL_MS
+#define TIMESTAMP_INTERVAL_MS 10000     //Time between timestamp lines, more than 0
+#endif
+#ifndef TIMESTAMP_FORMAT
+#define TIMESTAMP_FORMAT "timestamp:%F %H:%M:%S\n"     //strftime format of a timestamp line, at most 127 bytes once formatted
+#endif
+#ifndef USE_METRICS
+#define USE_METRICS 0       //Set to 1 to count what the server does and serve it on METRICS_PORT
+#endif
+#ifndef METRICS_PORT
+#define METRICS_PORT 9001   //Loopback port answering with the counters in the Prometheus text format
+#endif
+#ifndef USE_PERSISTENT_LOG
+#define USE_PERSISTENT_LOG 0    //Set to 1 to also keep every append in a memory-mapped log and restore the history from it on start
+#endif
+#ifndef LOG_DIR
+#define LOG_DIR "/var/tmp/aesdsocketlog"    //Directory the log segments are kept in
+#endif
+#ifndef LOG_SEGMENT_SIZE
+#define LOG_SEGMENT_SIZE (64UL << 20)   //Bytes preallocated per log segment, a larger record gets a segment its own size
+#endif
+#ifndef LOG_SYNC_MS
+#define LOG_SYNC_MS 100     //Longest an append stays in the log unsynced, 0 to make every append wait until it is on disk
+#endif
+#ifndef LOG_SYNC_BYTES
+#define LOG_SYNC_BYTES (1UL << 20)      //Unsynced bytes that start a log sync before LOG_SYNC_MS is up
+#endif
+#ifndef USE_SEGMENTS
+#define USE_SEGMENTS 0      //Set to 1 to keep the data file as a directory of fixed size segments with old ones deleted
+#endif
+#ifndef SEGMENT_SIZE
+#define SEGMENT_SIZE (16UL << 20)       //Bytes of the data file per segment file
+#endif
+#ifndef RETAIN_BYTES
+#define RETAIN_BYTES (1UL << 30)        //History kept when USE_SEGMENTS is set, rounded up to whole segments, 0 for no limit
+#endif
+#ifndef RETAIN_SECONDS
+#define RETAIN_SECONDS 0    //Age in seconds at which a full segment is deleted, 0 for no limit
+#endif
+#ifndef SEGMENT_INDEX_LINES
+#define SEGMENT_INDEX_LINES 1024        //Lines between the offsets the segment index keeps for seeking
+#endif
+#ifndef SEGMENT_CHECK_MS
+#define SEGMENT_CHECK_MS 1000   //How often full segments are indexed and expired ones deleted
+#endif
+#if USE_SEGMENTS == 1 && (USE_AESD_CHAR_DEVICE == 1 || USE_IO_URING == 1)
+#error "USE_SEGMENTS needs USE_AESD_CHAR_DEVICE=0, and USE_IO_URING=0 as io_uring registers a single data file"
+#endif
+#if MAX_PACKET < BUFFER || (USE_IO_URING == 1 && MAX_PACKET < URING_REPLAY_CHUNK)
+#error "MAX_PACKET must hold a BUFFER, and with USE_IO_URING the URING_REPLAY_CHUNK the receive buffer is reused for"
+#endif
+#if USE_GROUP_COMMIT == 1 && (USE_EPOLL == 1 || USE_IO_URING == 1)
+#error "USE_GROUP_COMMIT blocks each append until its batch is flushed, which would stall an epoll reactor or the io_uring thread"
+#endif
+#if USE_IO_URING == 1 && USE_PERSISTENT_LOG == 1 && LOG_SYNC_MS == 0
+#error "LOG_SYNC_MS=0 waits for each log append to be synced, which the io_uring thread can't do, use a nonzero LOG_SYNC_MS"
+#endif
+
+//
+//
+//Global variables
+//
+//
+extern const char* FILENAME;
+extern const char* LOG_PATH;
+extern int socket_fd;
+extern int file_fd;
+extern pthread_mutex_t fileMutex;
+
+typedef struct pthread_arg_t {      //Struct definition for multithreading
+    int new_socket_fd;
+    struct sockaddr_in client_address;      //Struct to save the client address
+    bool completed;
+} pthread_arg_t;
+
+enum metric {       //Counters kept per thread by metricAdd
+    METRIC_ACCEPTED,
+    METRIC_CLOSED,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_PACKETS,
+    METRIC_FILE_WAIT_NS,
+    METRIC_COMMIT_WAIT_NS,
+    METRIC_REPLAYS,
+    METRIC_REPLAY_NS,
+    METRIC_TIMESTAMPS,
+    METRIC_LOG_WAIT_NS,
+    METRIC_COUNT,
+};
+
+typedef struct recv_buffer_t {     //Per connection receive buffer, reused for every recv on the connection
+    char *buf;
+    size_t len;         //Bytes received so far
+    size_t cap;         //Allocated size of buf
+    size_t scanned;     //Bytes already searched for a newline
+} recv_buffer_t;
+
+//
+//
+//Function declarations
+//
+//
+
+// Thread routine to serve connection to client, frees arg when done
+void *pthread_routine(void *arg);
+
+//Receive until rb holds a newline, returns the packet length including the newline,
+//0 if a non-blocking socket has no more data yet, or -1 once the client is gone
+ssize_t packetReceive(int fd, recv_buffer_t *rb);
+
+//Make room for at least room more bytes plus a terminator in rb, returns false if it cannot grow or would hold more
+//than MAX_PACKET bytes
+bool packetReserve(recv_buffer_t *rb, size_t room);
+
+//Look for the newline in bytes of rb not scanned yet, returns the packet length including it or 0
+ssize_t packetScan(recv_buffer_t *rb);
+
+//Temporary file open
+void tmpfileOpen();
+
+//Delete the data file, or every segment and their directory
+void fileRemove();
+
+//Empty the data file and continue it at offset base, which must be 0 without USE_SEGMENTS. Offsets now count in
+//epoch, 0 to have fileEpoch pick a new one
+void fileReset(off_t base, uint64_t epoch);
+
+//Nonzero value naming the history data file offsets count in, a resume offset from another epoch is not valid
+uint64_t fileEpoch();
+
+//Append a record recovered from the persistent log, without logging it again
+void fileRestore(const char *buf, size_t len);
+
+//sendfile from the data file at offset, no further than end and in segment mode the end of the segment.
+//Advances offset, which moves up to the oldest byte still held if retention has deleted it. Returns as sendfile
+ssize_t fileSendfile(int sock_fd, off_t *offset, off_t end);
+
+//Append len bytes to the data file, safe to call from any number of threads, returns the offset the record ends at,
+//-1 for the char device
+off_t fileAppend(const char *buf, size_t len);
+
+//Append the concatenation of iov, which may be modified, to the data file as one record, returns as fileAppend
+off_t fileAppendv(struct iovec *iov, int iovcnt);
+
+//Reserve len bytes of the data file for a caller that writes them itself, returns the offset to write at
+off_t fileReserve(size_t len, uint16_t *ticket);
+
+//Mark a reservation written, once every earlier one is too its bytes become part of the committed length
+void filePublish(uint16_t ticket, size_t len);
+
+//Length of the data file that is fully written and safe to replay, -1 for the char device
+off_t fileCommitted();
+
+//Wait until the committed length reaches end, after an append that returned it
+void fileWaitCommitted(off_t end);
+
+//Start the thread appending a timestamp every TIMESTAMP_INTERVAL_MS, does nothing unless USE_TIMESTAMPS is set
+void timestampStart();
+
+//Append a complete packet or run the command it carries, returns the offset to replay from and sets replay_end.
+//A resume command writes a header of header_len bytes over the packet to send before the replay, so the packet
+//buffer must hold at least RESUME_HEADER bytes
+off_t packetAppend(char *packet, size_t len, off_t *replay_end, size_t *header_len);
+
+//Send the file from offset to end to a blocking socket without holding fileMutex, end of -1 replays the char device
+//until end of file
+void fileReplay(int sock_fd, off_t offset, off_t end);
+
+//Queue a packet for the group commit writer and wait until it is in the file, returns an offset at or past its end
+off_t groupCommit(const char *buf, size_t len);
+
+//Format the group commit flush count and its batch size and flush latency histograms
+void groupCommitStats(char *buf, size_t size);
+
+//Epoll reactor mode, serves every client accepted on listen_fd and never returns
+void epollServe(int listen_fd);
+
+//Worker pool mode, start the workers before the accept loop runs
+void poolStart();
+
+//Block the accept loop while the accept queue is full, does nothing when shedding load
+void poolReserve();
+
+//Queue an accepted client for the workers, returns false if it has to be shed
+bool poolSubmit(pthread_arg_t *pthread_arg);
+
+//Number of accepted clients waiting for a worker
+size_t poolDepth();
+
+//io_uring mode, serves every client accepted on listen_fd and never returns
+void uringServe(int listen_fd);
+
+//Recover the persistent log, refill the history from it and start its sync thread, does nothing unless
+//USE_PERSISTENT_LOG is set. Call once before any client is served
+void logOpen();
+
+//Copy the concatenation of iov, len bytes, into the persistent log. With a ticket the data file reservation is made
+//under the log's lock and its offset stored, so both keep the same order. Returns the sequence number for logWait
+uint64_t logAppend(const struct iovec *iov, int iovcnt, size_t len, uint16_t *ticket, off_t *offset);
+
+//Wait until the log append numbered sequence is on disk, only waits when LOG_SYNC_MS is 0
+void logWait(uint64_t sequence);
+
+//Write back everything appended to the log, for the exit path
+void logClose();
+
+//Drop the log segments that only hold data before offset start, which retention has deleted from the data file
+void logTrim(off_t start);
+
+//Load the segments in the directory fd, FILENAME, and start the thread indexing and deleting them.
+//Returns the end of the data they hold
+off_t segmentsOpen(int fd);
+
+//Delete every segment and continue the data file at offset base
+void segmentsReset(off_t base);
+
+//Delete every segment file in FILENAME, only using paths so it works before segmentsOpen and after file_fd is closed
+void segmentsRemove();
+
+//Oldest data file offset still held
+off_t segmentsStart();
+
+//Descriptor of the segment holding offset, created if needed, for writers, which must not close it.
+//limit is set to the offset the segment ends at. Returns -1 on error
+int segmentWriteFd(off_t offset, off_t *limit);
+
+//Duplicate descriptor of the segment holding offset for readers to close, moving offset up to the oldest byte held.
+//limit is set to the offset the segment ends at. Returns -1 if there is no such segment
+int segmentReadFd(off_t *offset, off_t *limit);
+
+//Data file offset of byte line_offset in line number line, counted from the first whole line held, or -1 if there is
+//no such byte
+off_t segmentSeek(uint32_t line, uint32_t line_offset);
+
+//Start the metrics listener thread, does nothing unless USE_METRICS is set
+void metricsStart();
+
+//Add value to one of the calling thread's counters
+void metricAdd(enum metric metric, uint64_t value);
+
+//Monotonic nanoseconds to pass to metricReplay, 0 without USE_METRICS
+uint64_t metricNow();
+
+//Count a replay that began at started, from metricNow
+void metricReplay(uint64_t started);
+
+//Lock mutex, adding any time spent waiting for it to metric
+void metricLock(pthread_mutex_t *mutex, enum metric metric);
+
+#endif /* AESDSOCKET_H */
@@ -0,0 +1,66 @@
+#include "unity.h"
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+#include "../../aesd-char-driver/aesd_ioctl.h"
+
+/**
+* The range AESDCHAR_IOCGETRANGE reports for @param buffer
+*/
+static struct aesd_range range_of(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_range range = { buffer->end - buffer->total_size, buffer->end, 1 };
+    return range;
+}
+
+/**
+* The byte at file offset @param offset of @param buffer, as a read from the device returns it
+*/
+static char byte_at(struct aesd_circular_buffer *buffer, size_t offset)
+{
+    size_t entry_offset;
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset, &entry_offset);
+    TEST_ASSERT_NOT_NULL(entry);
+    return entry->buffptr[entry_offset];
+}
+
+void test_circular_buffer_range_survives_eviction()
+{
+    struct aesd_circular_buffer buffer;
+    const char *writes[] = { "first\n", "second\n", "third\n", "fourth\n", "fifth\n" };
+    struct aesd_range range;
+
+    aesd_circular_buffer_init(&buffer);
+    aesd_circular_buffer_move(&buffer, NULL, 0, 3);
+    for (int i = 0; i < 3; i++) {
+        struct aesd_buffer_entry add = { writes[i], strlen(writes[i]) };
+        aesd_circular_buffer_add_entry(&buffer, &add);
+    }
+    range = range_of(&buffer);
+    uint64_t saved = range.start + 7;      //The 'e' in "second\n"
+    uint64_t dropped = range.start + 2;    //Inside "first\n"
+    uint64_t end = range.end;
+    size_t size = buffer.total_size;
+    TEST_ASSERT_EQUAL('e', byte_at(&buffer, aesd_range_offset(&range, saved)));
+
+    //Dropping "first\n" for a write of the same size leaves the size alone but moves every offset
+    struct aesd_buffer_entry add = { "FIRST\n", 6 };
+    aesd_circular_buffer_add_entry(&buffer, &add);
+    range = range_of(&buffer);
+    TEST_ASSERT_EQUAL_MESSAGE(size, buffer.total_size, "The replacement write keeps the size the same");
+    TEST_ASSERT_EQUAL_MESSAGE('e', byte_at(&buffer, aesd_range_offset(&range, saved)),
+                              "A position must name the same byte after older writes are dropped");
+    TEST_ASSERT_EQUAL_MESSAGE(-1, aesd_range_offset(&range, dropped), "A dropped byte has no offset");
+    TEST_ASSERT_EQUAL_MESSAGE(buffer.total_size - 6, aesd_range_offset(&range, end),
+                              "Resuming at the old end must only replay the new write");
+
+    //Writes dropped for the byte limit move the start the same way
+    buffer.byte_limit = 14;
+    struct aesd_buffer_entry removed;
+    while (aesd_circular_buffer_evict_for(&buffer, 7, &removed));
+    add = (struct aesd_buffer_entry) { writes[4], strlen(writes[4]) };
+    aesd_circular_buffer_add_entry(&buffer, &add);
+    range = range_of(&buffer);
+    TEST_ASSERT_EQUAL(-1, aesd_range_offset(&range, saved));
+    TEST_ASSERT_EQUAL('f', byte_at(&buffer, aesd_range_offset(&range, range.end - 6)));
+    TEST_ASSERT_EQUAL(-1, aesd_range_offset(&range, range.end + 1));
+}
@@ -0,0 +1,151 @@
+#include "unity.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "../../aesd-char-driver/aesd-lockfree-buffer.h"
+
+#define STRESS_SLOTS 64
+#define STRESS_ENTRIES 1000000
+#define STRESS_PRODUCERS 4
+
+/**
+* Entries in the threaded tests carry their producer and sequence number in buffptr and size instead of data
+*/
+struct producer_args
+{
+    struct aesd_lockfree_buffer *buffer;
+    uintptr_t producer;
+    size_t entries;
+    atomic_bool *stop;
+};
+
+/**
+* Waits for the other side after an attempt failed, sleeping once yielding has not helped for a while so the
+* test also makes progress on a single CPU
+*/
+static void back_off(unsigned *attempts)
+{
+    if (++*attempts < 64) {
+        sched_yield();
+    } else {
+        struct timespec pause = { 0, 10000 };
+        nanosleep(&pause, NULL);
+    }
+}
+
+static void *producer_routine(void *arg)
+{
+    struct producer_args *args = arg;
+    unsigned attempts = 0;
+    for (size_t seq = 0; seq < args->entries; seq++) {
+        struct aesd_buffer_entry entry = { (const char *) (args->producer + 1), seq };
+        while (!aesd_lockfree_buffer_add_entry(args->buffer, &entry)) {
+            if (atomic_load(args->stop)) return NULL;
+            back_off(&attempts);
+        }
+        attempts = 0;
+    }
+    return NULL;
+}
+
+/**
+* Runs @param producers threads each adding @param entries, taking them out on this thread as the consumer and
+* checking every producer's entries arrive complete and in order
+* The producers use slots, buffer and args on this stack, so a failure is only asserted once they are all joined
+*/
+static void run_producers(size_t producers, size_t entries)
+{
+    struct aesd_lockfree_slot slots[STRESS_SLOTS];
+    struct aesd_lockfree_buffer buffer;
+    struct producer_args args[STRESS_PRODUCERS];
+    pthread_t threads[STRESS_PRODUCERS];
+    size_t next_seq[STRESS_PRODUCERS] = { 0 };
+    struct aesd_buffer_entry removed;
+    unsigned attempts = 0;
+    atomic_bool stop = false;
+    const char *failure = NULL;
+    size_t started;
+
+    TEST_ASSERT_TRUE(aesd_lockfree_buffer_init(&buffer, slots, STRESS_SLOTS, producers > 1));
+    for (started = 0; started < producers; started++) {
+        args[started] = (struct producer_args) { &buffer, started, entries, &stop };
+        if (pthread_create(&threads[started], NULL, producer_routine, &args[started]) != 0) {
+            failure = "Could not start a producer";
+            break;
+        }
+    }
+    for (size_t received = 0; failure == NULL && received < producers * entries; ) {
+        if (!aesd_lockfree_buffer_remove_oldest(&buffer, &removed)) {
+            back_off(&attempts);
+            continue;
+        }
+        attempts = 0;
+        uintptr_t producer = (uintptr_t) removed.buffptr - 1;
+        if (producer >= producers) {
+            failure = "Entry from an unknown producer";
+        } else if (next_seq[producer] != removed.size) {
+            failure = "Entry lost or out of order";
+        } else {
+            next_seq[producer]++;
+            received++;
+        }
+    }
+    atomic_store(&stop, true);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    TEST_ASSERT_TRUE_MESSAGE(failure == NULL, failure);
+    TEST_ASSERT_FALSE(aesd_lockfree_buffer_remove_oldest(&buffer, &removed));
+}
+
+void test_lockfree_buffer_single_thread()
+{
+    struct aesd_lockfree_slot slots[4];
+    struct aesd_lockfree_buffer buffer;
+    struct aesd_buffer_entry *entry, removed;
+    const char *strings[] = { "write1\n", "write2\n", "write3\n", "write4\n", "write5\n" };
+    size_t offset, index;
+    int visited = 0;
+
+    TEST_ASSERT_FALSE_MESSAGE(aesd_lockfree_buffer_init(&buffer, slots, 3, false), "Slot count must be a power of two");
+    TEST_ASSERT_TRUE(aesd_lockfree_buffer_init(&buffer, slots, 4, false));
+    TEST_ASSERT_NULL(aesd_lockfree_buffer_find_entry_offset_for_fpos(&buffer, 0, &offset));
+    for (int i = 0; i < 4; i++) {
+        struct aesd_buffer_entry add = { strings[i], strlen(strings[i]) };
+        TEST_ASSERT_TRUE(aesd_lockfree_buffer_add_entry(&buffer, &add));
+    }
+    struct aesd_buffer_entry add = { strings[4], strlen(strings[4]) };
+    TEST_ASSERT_FALSE_MESSAGE(aesd_lockfree_buffer_add_entry(&buffer, &add), "A full buffer must refuse entries");
+
+    entry = aesd_lockfree_buffer_find_entry_offset_for_fpos(&buffer, 9, &offset);
+    TEST_ASSERT_NOT_NULL(entry);
+    TEST_ASSERT_EQUAL_PTR(strings[1], entry->buffptr);
+    TEST_ASSERT_EQUAL(2, offset);
+    TEST_ASSERT_NULL(aesd_lockfree_buffer_find_entry_offset_for_fpos(&buffer, 28, &offset));
+
+    TEST_ASSERT_TRUE(aesd_lockfree_buffer_remove_oldest(&buffer, &removed));
+    TEST_ASSERT_EQUAL_PTR(strings[0], removed.buffptr);
+    TEST_ASSERT_TRUE(aesd_lockfree_buffer_add_entry(&buffer, &add));
+    entry = aesd_lockfree_buffer_find_entry_offset_for_fpos(&buffer, 27, &offset);
+    TEST_ASSERT_NOT_NULL(entry);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(strings[4], entry->buffptr, "The entry added after wrapping must be the newest");
+    TEST_ASSERT_EQUAL(6, offset);
+
+    AESD_LOCKFREE_BUFFER_FOREACH(entry, &buffer, index) {
+        TEST_ASSERT_EQUAL_PTR(strings[visited + 1], entry->buffptr);
+        visited++;
+    }
+    TEST_ASSERT_EQUAL_INT(4, visited);
+}
+
+void test_lockfree_buffer_single_producer_stress()
+{
+    run_producers(1, STRESS_ENTRIES);
+}
+
+void test_lockfree_buffer_multi_producer_stress()
+{
+    run_producers(STRESS_PRODUCERS, STRESS_ENTRIES / STRESS_PRODUCERS);
+}